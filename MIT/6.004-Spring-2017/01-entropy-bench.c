@@ -0,0 +1,861 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "util/entropy.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_RDTSC 1
+#endif
+
+#define BENCH_BLOCK_SIZE (128 << 10)
+// The default block size of `entropy -c`
+#define BENCH_ROUNDS 3
+
+double seconds_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * cycles_now function reads the time stamp counter, which counts at a fixed
+ * rate close to the nominal clock of the CPU. It returns 0 where there's no
+ * such counter and the cycles columns are printed as "-" then.
+ */
+uint64_t cycles_now(void) {
+#if defined(BENCH_RDTSC)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static inline uint64_t xorshift64(uint64_t* x) {
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return *x;
+}
+
+typedef enum {
+    INPUT_UNIFORM,
+    INPUT_ZIPF,
+    INPUT_SINGLE,
+    INPUT_TEXT,
+    INPUT_KINDS,
+} InputKind;
+
+static const char* input_names[INPUT_KINDS] = { "uniform", "zipf", "single", "text" };
+
+/**
+ * generate_input function fills data with one of the generated inputs:
+ *
+ * - uniform: every byte is random, the entropy is 8 bits,
+ * - zipf:    the k-th of the 256 bytes appears ∝ 1/(k+1) times,
+ * - single:  all bytes are the same, the entropy is 0,
+ * - text:    random words of an English sentence, separated by spaces.
+ */
+void generate_input(InputKind kind, unsigned char* data, size_t length) {
+    static const char* words[] = { "the", "of", "and", "to", "in", "is", "information", "entropy",
+                                   "huffman", "code", "average", "message", "bits", "a", "each",
+                                   "symbol", "gets", "close", "it", "with", "shorter", "codes" };
+    uint64_t x = 88172645463325252ull;
+    if (kind == INPUT_ZIPF) {
+        double cumulative[ASCII], total = 0.0;
+        for (int k = 0; k < ASCII; ++k) {
+            total += 1.0 / (k + 1);
+            cumulative[k] = total;
+        }
+        for (size_t i = 0; i < length; ++i) {
+            double u = (xorshift64(&x) >> 11) * (1.0 / 9007199254740992.0) * total;
+            int low = 0, high = ASCII - 1;
+            while (low < high) {
+                int middle = (low + high) / 2;
+                if (cumulative[middle] < u) low = middle + 1; else high = middle;
+            }
+            data[i] = (unsigned char)low;
+        }
+        return;
+    }
+    for (size_t i = 0; i < length;) {
+        if (kind == INPUT_UNIFORM) {
+            data[i++] = (unsigned char)xorshift64(&x);
+        } else if (kind == INPUT_SINGLE) {
+            data[i++] = 'e';
+        } else {
+            const char* word = words[xorshift64(&x) % (sizeof(words) / sizeof(words[0]))];
+            for (size_t j = 0; word[j] && i < length; ++j) {
+                data[i++] = (unsigned char)word[j];
+            }
+            if (i < length) data[i++] = xorshift64(&x) % 12 == 0 ? '\n' : ' ';
+        }
+    }
+}
+
+/**
+ * BenchCoder is one way to code the blocks, every input is run with each.
+ */
+typedef struct {
+    const char* name;
+    EntropyEncoderOptions options;
+} BenchCoder;
+
+static const BenchCoder coders[] = {
+    { "huffman", { BUILDER_HEAP, 0, 1, ENGINE_HUFFMAN, 0 } },
+    { "huffman4", { BUILDER_HEAP, 0, HUFFMAN_STREAMS, ENGINE_HUFFMAN, 0 } },
+    { "tans", { BUILDER_HEAP, 0, 1, ENGINE_TANS, 0 } },
+    { "auto", { BUILDER_HEAP, 0, 1, ENGINE_AUTO, 0 } },
+};
+
+/**
+ * CodecResult is one row of bench_codec, every time is the best of
+ * BENCH_ROUNDS runs.
+ */
+typedef struct {
+    double entropy;
+    // order-0 entropy of the whole input, bits per byte
+    double bits_per_byte;
+    double entropy_seconds;
+    double build_ns;
+    double encode_seconds, decode_seconds;
+    uint64_t encode_cycles, decode_cycles;
+} CodecResult;
+
+/**
+ * bench_codec_input function measures on one input, as the library is used:
+ *
+ * - entropy: symbol_stats of the whole input and information_entropy,
+ * - build:   build_huffman_codes on the histogram of the first block (only
+ *            for Huffman, tANS builds its tables inside the encoder),
+ * - encode:  entropy_encode_block for every block of BENCH_BLOCK_SIZE bytes,
+ * - decode:  entropy_decode_block for all of them, and checks the result.
+ *
+ * It returns -1 if the decoded data isn't the input.
+ */
+int bench_codec_input(const unsigned char* data, size_t length, const EntropyEncoderOptions* options,
+                      CodecResult* result) {
+    size_t blocks = (length + BENCH_BLOCK_SIZE - 1) / BENCH_BLOCK_SIZE;
+    size_t capacity = blocks * entropy_block_bound(BENCH_BLOCK_SIZE);
+    unsigned char* packed = (unsigned char*)malloc(capacity);
+    unsigned char* decoded = (unsigned char*)malloc(length);
+    EntropyEncoder* encoder = entropy_encoder_create(options);
+    EntropyDecoder* decoder = entropy_decoder_create();
+    int status = -1;
+    if (!packed || !decoded || !encoder || !decoder) {
+        perror("malloc");
+        goto done;
+    }
+
+    memset(result, 0, sizeof(CodecResult));
+    SymbolStats stats;
+    for (int round = 0; round < BENCH_ROUNDS; ++round) {
+        double start = seconds_now();
+        symbol_stats_init(&stats);
+        symbol_stats_update(&stats, data, length);
+        symbol_stats_finish(&stats);
+        result->entropy = information_entropy(&stats);
+        double elapsed = seconds_now() - start;
+        if (round == 0 || elapsed < result->entropy_seconds) result->entropy_seconds = elapsed;
+    }
+
+    symbol_stats_init(&stats);
+    symbol_stats_update(&stats, data, length < BENCH_BLOCK_SIZE ? length : BENCH_BLOCK_SIZE);
+    symbol_stats_finish(&stats);
+    if (options->engine == ENGINE_HUFFMAN) {
+        HuffmanCode table[ASCII];
+        int builds = 20000;
+        double start = seconds_now();
+        for (int i = 0; i < builds; ++i) {
+            build_huffman_codes(&stats, options->builder, options->max_bits, table);
+        }
+        result->build_ns = (seconds_now() - start) / builds * 1e9;
+    }
+
+    size_t packed_length = 0;
+    for (int round = 0; round < BENCH_ROUNDS; ++round) {
+        packed_length = 0;
+        double start = seconds_now();
+        uint64_t cycles = cycles_now();
+        for (size_t offset = 0; offset < length; offset += BENCH_BLOCK_SIZE) {
+            size_t n = length - offset < BENCH_BLOCK_SIZE ? length - offset : BENCH_BLOCK_SIZE;
+            size_t written;
+            if (entropy_encode_block(encoder, data + offset, n, packed + packed_length, capacity - packed_length,
+                                     &written) != ENTROPY_OK) goto done;
+            packed_length += written;
+        }
+        cycles = cycles_now() - cycles;
+        double elapsed = seconds_now() - start;
+        if (round == 0 || elapsed < result->encode_seconds) {
+            result->encode_seconds = elapsed;
+            result->encode_cycles = cycles;
+        }
+    }
+    result->bits_per_byte = 8.0 * packed_length / length;
+
+    for (int round = 0; round < BENCH_ROUNDS; ++round) {
+        double start = seconds_now();
+        uint64_t cycles = cycles_now();
+        size_t in = 0, out = 0;
+        while (in < packed_length) {
+            BlockHeader header;
+            block_header_read(packed + in, &header);
+            size_t written;
+            if (entropy_decode_block(decoder, packed + in, packed_length - in, decoded + out, length - out,
+                                     &written) != ENTROPY_OK) goto done;
+            in += BLOCK_HEADER_SIZE + header.payload_length;
+            out += written;
+        }
+        cycles = cycles_now() - cycles;
+        double elapsed = seconds_now() - start;
+        if (out != length || memcmp(decoded, data, length) != 0) goto done;
+        if (round == 0 || elapsed < result->decode_seconds) {
+            result->decode_seconds = elapsed;
+            result->decode_cycles = cycles;
+        }
+    }
+    status = 0;
+
+done:
+    free(packed);
+    free(decoded);
+    entropy_encoder_destroy(encoder);
+    entropy_decoder_destroy(decoder);
+    return status;
+}
+
+void print_codec_result(const char* name, size_t length, const char* coder, const CodecResult* result) {
+    char encode_cycles[16] = "-", decode_cycles[16] = "-", build_ns[16] = "-";
+    if (result->build_ns > 0.0) snprintf(build_ns, sizeof(build_ns), "%.0f", result->build_ns);
+    if (result->encode_cycles) snprintf(encode_cycles, sizeof(encode_cycles), "%.2f", (double)result->encode_cycles / length);
+    if (result->decode_cycles) snprintf(decode_cycles, sizeof(decode_cycles), "%.2f", (double)result->decode_cycles / length);
+    double overhead = result->entropy > 0.0 ? (result->bits_per_byte / result->entropy - 1.0) * 100.0 : 0.0;
+    printf("%-10s %-8s %8.4f %8.4f %8.2f%% %8.4f %9s %8.1f %6s %8.1f %6s %8.1f\n", name, coder,
+           result->entropy, result->bits_per_byte, overhead, result->bits_per_byte / 8.0, build_ns, length / result->encode_seconds / 1e6, encode_cycles,
+           length / result->decode_seconds / 1e6, decode_cycles, length / result->entropy_seconds / 1e6);
+}
+
+/**
+ * bench_codec function runs bench_codec_input on the generated inputs of
+ * megabytes MiB and on every file of the corpus, with every coder:
+ *
+ *   entropy   order-0 entropy in bits per byte, the bound of any code here
+ *   bits/B    bits per byte of the compressed blocks, headers included
+ *   over      how far bits/B is above the entropy, it's below 0 when the
+ *             tables of the blocks follow a drift the whole input hides
+ *   ratio     compressed size / input size
+ *   build     ns per build_huffman_codes
+ *   enc, dec  MB/s and cycles per byte, H MB/s is counting plus entropy
+ */
+int bench_codec(size_t megabytes, char* files[], int count) {
+    size_t length = megabytes << 20;
+    unsigned char* data = (unsigned char*)malloc(length);
+    if (!data) {
+        perror("malloc");
+        return 1;
+    }
+    printf("%-10s %-8s %8s %8s %9s %8s %9s %8s %6s %8s %6s %8s\n", "input", "coder", "entropy", "bits/B",
+           "over", "ratio", "build ns", "enc MB/s", "cyc/B", "dec MB/s", "cyc/B", "H MB/s");
+    int status = 0;
+    for (int kind = 0; kind < INPUT_KINDS + count; ++kind) {
+        const char* name;
+        size_t n = length;
+        if (kind < INPUT_KINDS) {
+            name = input_names[kind];
+            generate_input((InputKind)kind, data, length);
+        } else {
+            name = files[kind - INPUT_KINDS];
+            FILE* input = fopen(name, "rb");
+            if (!input) {
+                perror(name);
+                status = 1;
+                continue;
+            }
+            n = fread(data, 1, length, input);
+            fclose(input);
+            if (n == 0) continue;
+            const char* slash = strrchr(name, '/');
+            name = slash ? slash + 1 : name;
+            // Files longer than megabytes MiB are cut there
+        }
+        for (size_t c = 0; c < sizeof(coders) / sizeof(coders[0]); ++c) {
+            CodecResult result;
+            if (bench_codec_input(data, n, &coders[c].options, &result) < 0) {
+                fprintf(stderr, "%s: the %s round trip failed\n", name, coders[c].name);
+                status = 1;
+                continue;
+            }
+            print_codec_result(name, n, coders[c].name, &result);
+        }
+    }
+    free(data);
+    return status;
+}
+
+/**
+ * bench_histogram_kernel function runs a histogram kernel over data several
+ * times and returns the best throughput in GB/s.
+ */
+double bench_histogram_kernel(void (*kernel)(const unsigned char*, size_t, uint64_t[]),
+                              const unsigned char* data, size_t length) {
+    double best = 0.0;
+    for (int round = 0; round < 5; ++round) {
+        uint64_t appear_times[ASCII] = { 0 };
+        double start = seconds_now();
+        kernel(data, length, appear_times);
+        double elapsed = seconds_now() - start;
+        if (appear_times[data[0]] == 0) return 0.0;
+        // Reading the result keeps the compiler from dropping the call
+        double speed = length / elapsed / 1e9;
+        if (speed > best) best = speed;
+    }
+    return best;
+}
+
+/**
+ * bench_histogram function compares the histogram kernels on three inputs:
+ *
+ * - uniform: every byte is random, the counters hardly ever collide,
+ * - skewed:  90% of bytes are 'e' and the rest are random letters, like a
+ *            very repetitive log,
+ * - single:  all bytes are the same, the worst case of the naive loop.
+ */
+int bench_histogram(size_t megabytes) {
+    size_t length = megabytes << 20;
+    unsigned char* data = (unsigned char*)malloc(length);
+    if (!data) {
+        perror("malloc");
+        return 1;
+    }
+    const char* names[] = { "uniform", "skewed", "single" };
+
+    printf("%-10s %10s %10s %10s\n", "input", "naive", "scalar", "dispatch");
+    for (int kind = 0; kind < 3; ++kind) {
+        uint64_t x = 88172645463325252ull;
+        for (size_t i = 0; i < length; ++i) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            // xorshift64, good enough as a byte source
+            if (kind == 0) {
+                data[i] = (unsigned char)x;
+            } else if (kind == 1) {
+                data[i] = (x % 10 != 0) ? 'e' : (unsigned char)('a' + (x >> 8) % 26);
+            } else {
+                data[i] = 'e';
+            }
+        }
+        printf("%-10s %7.2f GB/s %7.2f GB/s %7.2f GB/s\n", names[kind],
+               bench_histogram_kernel(histogram_naive, data, length),
+               bench_histogram_kernel(histogram_scalar, data, length),
+               bench_histogram_kernel(histogram_count, data, length));
+    }
+
+    free(data);
+    return 0;
+}
+
+/**
+ * bench_entropy function compares information_entropy with
+ * information_entropy_fast on blocks of 4 KiB, each with about `b` random
+ * bits per byte for a different b, and prints the time per block of both plus
+ * the biggest difference seen.
+ */
+int bench_entropy(void) {
+    enum { BLOCK = 4096, BLOCKS = 4096 };
+    unsigned char* data = (unsigned char*)malloc((size_t)BLOCK * BLOCKS);
+    if (!data) {
+        perror("malloc");
+        return 1;
+    }
+    uint64_t x = 88172645463325252ull;
+    for (size_t i = 0; i < (size_t)BLOCK * BLOCKS; ++i) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        int bits = 1 + (int)(i / BLOCK % 8);
+        data[i] = (unsigned char)(x & ((1u << bits) - 1));
+    }
+
+    SymbolStats stats;
+    double exact_time = 0.0, fast_time = 0.0, max_error = 0.0, checksum = 0.0;
+    for (size_t b = 0; b < BLOCKS; ++b) {
+        symbol_stats_init(&stats);
+        symbol_stats_update(&stats, data + b * BLOCK, BLOCK);
+        symbol_stats_finish(&stats);
+
+        double start = seconds_now();
+        double exact = information_entropy(&stats);
+        double middle = seconds_now();
+        double fast = information_entropy_fast(stats.appear_times, stats.length);
+        fast_time += seconds_now() - middle;
+        exact_time += middle - start;
+        if (fabs(exact - fast) > max_error) max_error = fabs(exact - fast);
+        checksum += exact + fast;
+    }
+    printf("%-10s %12s %12s %14s\n", "block", "exact", "fast", "max error");
+    printf("%-10d %9.0f ns %9.0f ns %14.3g\n", BLOCK, exact_time / BLOCKS * 1e9, fast_time / BLOCKS * 1e9,
+           max_error);
+    free(data);
+    return checksum > 0.0 ? 0 : 1;
+}
+
+/**
+ * bench_build_kernel function returns the average ns of one build_huffman_codes
+ * call, and the total encoding bits of the result in bits.
+ */
+double bench_build_kernel(const SymbolStats* stats, HuffmanBuilder builder, uint64_t* bits) {
+    HuffmanCode table[ASCII];
+    int rounds = 20000;
+    double start = seconds_now();
+    for (int round = 0; round < rounds; ++round) {
+        build_huffman_codes(stats, builder, 0, table);
+    }
+    double elapsed = seconds_now() - start;
+    *bits = 0;
+    for (int i = 0; i < ASCII; ++i) {
+        *bits += stats->appear_times[i] * table[i].length;
+    }
+    return elapsed / rounds * 1e9;
+}
+
+/**
+ * bench_build function compares the two tree builders (both followed by the
+ * canonical code assignment) on the histograms of:
+ *
+ * - text:    the byte frequencies of English text,
+ * - uniform: all 256 symbols with almost the same count,
+ * - zipf:    all 256 symbols, the k-th one appears ∝ 1/k times,
+ * - small:   a 16 symbols alphabet, like a hex dump.
+ */
+int bench_build(void) {
+    static const char* sample = "The quick brown fox jumps over the lazy dog. "
+                                "Information entropy is the average amount of information "
+                                "in each message, and Huffman coding gets close to it.\n";
+    const char* names[] = { "text", "uniform", "zipf", "small" };
+    SymbolStats stats;
+
+    printf("%-10s %8s %14s %14s %12s\n", "histogram", "symbols", "heap", "inplace", "same bits");
+    for (int kind = 0; kind < 4; ++kind) {
+        symbol_stats_init(&stats);
+        for (int i = 0; i < ASCII; ++i) {
+            if (kind == 1) stats.appear_times[i] = 1000 + i % 7;
+            if (kind == 2) stats.appear_times[i] = 1000000 / (i + 1);
+            if (kind == 3 && i < 16) stats.appear_times[i] = 100 + i * 13;
+        }
+        if (kind == 0) {
+            for (int r = 0; r < 1000; ++r) {
+                symbol_stats_update(&stats, (const unsigned char*)sample, strlen(sample));
+            }
+        }
+        for (int i = 0; i < ASCII; ++i) {
+            stats.length += kind == 0 ? 0 : stats.appear_times[i];
+        }
+        symbol_stats_finish(&stats);
+
+        uint64_t heap_bits, inplace_bits;
+        double heap_ns = bench_build_kernel(&stats, BUILDER_HEAP, &heap_bits);
+        double inplace_ns = bench_build_kernel(&stats, BUILDER_INPLACE, &inplace_bits);
+        printf("%-10s %8d %11.0f ns %11.0f ns %12s\n", names[kind], stats.count, heap_ns, inplace_ns,
+               heap_bits == inplace_bits ? "yes" : "NO");
+    }
+    return 0;
+}
+
+/**
+ * bench_tokens function runs the wide alphabet path on 4M tokens of:
+ *
+ * - zipf16: 16-bit tokens, the k-th of 65536 appears ∝ 1/(k+1) times, so the
+ *           counts are a dense array,
+ * - ids32:  32-bit ids spread over the whole range with a zipf-like tail, so
+ *           they go through the hash table.
+ *
+ * Count, build, encode and decode are in million tokens per second, and the
+ * decoded tokens are checked against the input.
+ */
+int bench_tokens(void) {
+    const size_t length = 4 << 20;
+    uint32_t* tokens = (uint32_t*)malloc(length * sizeof(uint32_t));
+    uint32_t* decoded = (uint32_t*)malloc(length * sizeof(uint32_t));
+    unsigned char* coded = (unsigned char*)malloc(length * sizeof(uint32_t) + 8);
+    if (!tokens || !decoded || !coded) {
+        perror("malloc");
+        return 1;
+    }
+    int status = 0;
+    printf("%-8s %9s %9s %10s %10s %10s %10s\n", "tokens", "distinct", "bits", "count", "build", "encode",
+           "decode");
+    for (int kind = 0; kind < 2; ++kind) {
+        uint64_t x = 88172645463325252ull;
+        for (size_t i = 0; i < length; ++i) {
+            double u = (xorshift64(&x) >> 11) * (1.0 / 9007199254740992.0);
+            tokens[i] = kind == 0 ? (uint32_t)(pow(65536.0, u) - 1.0)
+                                  : (uint32_t)((uint64_t)exp(u * 12.0) * 2654435761u);
+        }
+
+        WideStats stats;
+        HuffmanCode* codes = NULL;
+        WideDecoder decoder = { 0 };
+        double start = seconds_now();
+        if (wide_stats_init(&stats, kind == 0 ? 1u << 16 : 1ull << 32) < 0 ||
+            wide_stats_update(&stats, tokens, length) < 0 || wide_stats_finish(&stats) < 0) {
+            perror("malloc");
+            status = 1;
+            goto next;
+        }
+        double count_time = seconds_now() - start;
+        codes = (HuffmanCode*)malloc((stats.count + 1) * sizeof(HuffmanCode));
+        start = seconds_now();
+        if (!codes || build_wide_codes(&stats, codes) < 0) {
+            status = 1;
+            goto next;
+        }
+        double build_time = seconds_now() - start;
+        start = seconds_now();
+        long size = wide_encode(&stats, codes, tokens, length, coded);
+        double encode_time = seconds_now() - start;
+        if (wide_decoder_init(&decoder, stats.kind, codes, stats.count) < 0) {
+            status = 1;
+            goto next;
+        }
+        start = seconds_now();
+        long got = wide_decode(&decoder, coded, (size_t)size, decoded, length);
+        double decode_time = seconds_now() - start;
+        if (got != (long)length || memcmp(tokens, decoded, length * sizeof(uint32_t)) != 0) {
+            fprintf(stderr, "%s: decoded tokens differ\n", kind == 0 ? "zipf16" : "ids32");
+            status = 1;
+        }
+        printf("%-8s %9zu %9.4f %8.1f/s %8.1f/s %8.1f/s %8.1f/s\n", kind == 0 ? "zipf16" : "ids32", stats.count,
+               8.0 * size / length, length / count_time / 1e6, length / build_time / 1e6,
+               length / encode_time / 1e6, length / decode_time / 1e6);
+    next:
+        wide_decoder_free(&decoder);
+        free(codes);
+        wide_stats_free(&stats);
+    }
+    printf("(M tokens per second)\n");
+    free(tokens);
+    free(decoded);
+    free(coded);
+    return status;
+}
+
+/**
+ * bench_service_run function encodes all messages through a service of
+ * threads workers taking up to batch requests at a time, and returns the
+ * seconds from the first submit to the last completion (or -1).
+ */
+double bench_service_run(const unsigned char* data, size_t messages, size_t message_size, EntropyRequest* requests,
+                         unsigned char* coded, size_t bound, EntropyEngine engine, int threads, int batch) {
+    EntropyServiceOptions options = { { BUILDER_HEAP, 0, 1, engine, 0 }, threads, batch, NULL, 0 };
+    EntropyService* service = entropy_service_create(&options);
+    if (!service) return -1.0;
+    EntropyRequest* done[256];
+    double start = seconds_now();
+    for (size_t i = 0; i < messages; ++i) {
+        EntropyRequest request = { data + i * message_size, message_size, coded + i * bound, bound, NULL, NULL, 0,
+                                   ENTROPY_OK, NULL };
+        requests[i] = request;
+        if (entropy_service_submit(service, &requests[i]) != ENTROPY_OK) {
+            entropy_service_destroy(service);
+            return -1.0;
+        }
+    }
+    for (size_t completed = 0; completed < messages;) {
+        completed += entropy_service_poll(service, done, 256, 1);
+    }
+    double seconds = seconds_now() - start;
+    entropy_service_destroy(service);
+    return seconds;
+}
+
+/**
+ * bench_service function codes 16384 text messages of 1 KiB with Huffman and
+ * with ENGINE_AUTO: one entropy_encode_block each on this thread, then through
+ * services of 1 and 4 workers with and without batching. Every output is
+ * decoded and checked, the size column shows what the shared tables cost.
+ */
+int bench_service(void) {
+    const size_t messages = 16384, message_size = 1024;
+    const size_t bound = entropy_block_bound(message_size);
+    unsigned char* data = (unsigned char*)malloc(messages * message_size);
+    unsigned char* coded = (unsigned char*)malloc(messages * bound);
+    unsigned char* decoded = (unsigned char*)malloc(message_size);
+    EntropyRequest* requests = (EntropyRequest*)malloc(messages * sizeof(EntropyRequest));
+    EntropyDecoder* decoder = entropy_decoder_create();
+    if (!data || !coded || !decoded || !requests || !decoder) {
+        perror("malloc");
+        return 1;
+    }
+    generate_input(INPUT_TEXT, data, messages * message_size);
+
+    static const int runs[][2] = { { 0, 0 }, { 1, 1 }, { 1, 64 }, { 4, 1 }, { 4, 64 } };
+    static const EntropyEngine engines[] = { ENGINE_HUFFMAN, ENGINE_AUTO };
+    int status = 0;
+    printf("%-10s %8s %8s %12s %10s\n", "engine", "threads", "batch", "messages", "size");
+    for (size_t k = 0; k < 2 * sizeof(runs) / sizeof(runs[0]); ++k) {
+        size_t r = k % (sizeof(runs) / sizeof(runs[0]));
+        EntropyEngine engine = engines[k / (sizeof(runs) / sizeof(runs[0]))];
+        double seconds;
+        if (runs[r][0] == 0) {
+            EntropyEncoderOptions options = { BUILDER_HEAP, 0, 1, engine, 0 };
+            EntropyEncoder* encoder = entropy_encoder_create(&options);
+            if (!encoder) {
+                perror("malloc");
+                status = 1;
+                break;
+            }
+            double start = seconds_now();
+            for (size_t i = 0; i < messages; ++i) {
+                requests[i].status = entropy_encode_block(encoder, data + i * message_size, message_size,
+                                                          coded + i * bound, bound, &requests[i].written);
+            }
+            seconds = seconds_now() - start;
+            entropy_encoder_destroy(encoder);
+        } else {
+            seconds = bench_service_run(data, messages, message_size, requests, coded, bound, engine, runs[r][0],
+                                        runs[r][1]);
+        }
+        size_t size = 0;
+        for (size_t i = 0; i < messages && seconds >= 0; ++i) {
+            size_t written;
+            if (requests[i].status != ENTROPY_OK ||
+                entropy_decode_block(decoder, coded + i * bound, requests[i].written, decoded, message_size,
+                                     &written) != ENTROPY_OK ||
+                written != message_size || memcmp(decoded, data + i * message_size, message_size) != 0) {
+                seconds = -1.0;
+            }
+            size += requests[i].written;
+        }
+        if (seconds < 0) {
+            fprintf(stderr, "service: %d threads, batch %d: decoded data differ\n", runs[r][0], runs[r][1]);
+            status = 1;
+            continue;
+        }
+        if (runs[r][0] == 0) {
+            printf("%-10s %8s %8s %10.0f/s %10zu\n", engine == ENGINE_AUTO ? "auto" : "huffman", "-", "-",
+                   messages / seconds, size);
+        } else {
+            printf("%-10s %8d %8d %10.0f/s %10zu\n", "", runs[r][0], runs[r][1], messages / seconds, size);
+        }
+    }
+    entropy_decoder_destroy(decoder);
+    free(data);
+    free(coded);
+    free(decoded);
+    free(requests);
+    return status;
+}
+
+/**
+ * bench_vectors function codes 64 KiB blocks of text that arrive as TCP
+ * segments of 1448 bytes, scattered in their own buffers. "gather" copies a
+ * block together before entropy_encode_block and decodes it to one buffer
+ * that is then copied out to the segments; "vectors" runs
+ * entropy_encode_block_vectors and entropy_decode_block_vectors on the
+ * segments as they are. Both are in MB/s of raw data.
+ */
+int bench_vectors(void) {
+    const size_t block_size = 64 << 10, segment_size = 1448, blocks = 256;
+    const int segments = (int)((block_size + segment_size - 1) / segment_size);
+    unsigned char* data = (unsigned char*)malloc(blocks * block_size);
+    unsigned char* fragments = (unsigned char*)malloc(blocks * segments * 2 * segment_size);
+    unsigned char* joined = (unsigned char*)malloc(block_size);
+    unsigned char* coded = (unsigned char*)malloc(blocks * entropy_block_bound(block_size));
+    size_t* sizes = (size_t*)malloc(blocks * sizeof(size_t));
+    struct iovec* vectors = (struct iovec*)malloc(blocks * segments * sizeof(struct iovec));
+    EntropyEncoderOptions options = { BUILDER_HEAP, 0, 1, ENGINE_AUTO, 0 };
+    EntropyEncoder* encoder = entropy_encoder_create(&options);
+    EntropyDecoder* decoder = entropy_decoder_create();
+    if (!data || !fragments || !joined || !coded || !sizes || !vectors || !encoder || !decoder) {
+        perror("malloc");
+        return 1;
+    }
+    generate_input(INPUT_TEXT, data, blocks * block_size);
+    for (size_t b = 0; b < blocks; ++b) {
+        for (int k = 0; k < segments; ++k) {
+            struct iovec* vector = &vectors[b * segments + k];
+            size_t offset = (size_t)k * segment_size;
+            vector->iov_base = fragments + (b * segments + k) * 2 * segment_size;
+            // Every other segment_size bytes, like buffers out of a pool
+            vector->iov_len = block_size - offset < segment_size ? block_size - offset : segment_size;
+            memcpy(vector->iov_base, data + b * block_size + offset, vector->iov_len);
+        }
+    }
+
+    const size_t bound = entropy_block_bound(block_size);
+    int status = 0;
+    printf("%-10s %12s %12s\n", "vectors", "encode", "decode");
+    for (int gather = 1; gather >= 0; --gather) {
+        double encode_best = 0.0, decode_best = 0.0;
+        for (int round = 0; round < BENCH_ROUNDS; ++round) {
+            double start = seconds_now();
+            for (size_t b = 0; b < blocks; ++b) {
+                const struct iovec* block = &vectors[b * segments];
+                if (gather) {
+                    unsigned char* p = joined;
+                    for (int k = 0; k < segments; ++k) {
+                        memcpy(p, block[k].iov_base, block[k].iov_len);
+                        p += block[k].iov_len;
+                    }
+                    entropy_encode_block(encoder, joined, block_size, coded + b * bound, bound, &sizes[b]);
+                } else {
+                    entropy_encode_block_vectors(encoder, block, segments, coded + b * bound, bound, &sizes[b]);
+                }
+            }
+            double encode_seconds = seconds_now() - start;
+
+            start = seconds_now();
+            for (size_t b = 0; b < blocks; ++b) {
+                const struct iovec* block = &vectors[b * segments];
+                size_t written;
+                EntropyStatus decoded;
+                if (gather) {
+                    decoded = entropy_decode_block(decoder, coded + b * bound, sizes[b], joined, block_size, &written);
+                    const unsigned char* p = joined;
+                    for (int k = 0; k < segments; ++k) {
+                        memcpy(block[k].iov_base, p, block[k].iov_len);
+                        p += block[k].iov_len;
+                    }
+                } else {
+                    decoded = entropy_decode_block_vectors(decoder, coded + b * bound, sizes[b], block, segments,
+                                                           &written);
+                }
+                if (decoded != ENTROPY_OK || written != block_size) status = 1;
+            }
+            double decode_seconds = seconds_now() - start;
+            double encode_rate = blocks * block_size / encode_seconds / 1e6;
+            double decode_rate = blocks * block_size / decode_seconds / 1e6;
+            if (encode_rate > encode_best) encode_best = encode_rate;
+            if (decode_rate > decode_best) decode_best = decode_rate;
+        }
+        for (size_t b = 0; b < blocks; ++b) {
+            for (int k = 0; k < segments; ++k) {
+                const struct iovec* vector = &vectors[b * segments + k];
+                if (memcmp(vector->iov_base, data + b * block_size + (size_t)k * segment_size, vector->iov_len) != 0) {
+                    status = 1;
+                }
+            }
+        }
+        printf("%-10s %9.1f MB/s %9.1f MB/s\n", gather ? "gather" : "vectors", encode_best, decode_best);
+    }
+    if (status) fprintf(stderr, "vectors: decoded data differ\n");
+    entropy_encoder_destroy(encoder);
+    entropy_decoder_destroy(decoder);
+    free(data);
+    free(fragments);
+    free(joined);
+    free(coded);
+    free(sizes);
+    free(vectors);
+    return status;
+}
+
+void print_usage(const char* program) {
+    fprintf(stderr,
+            "Usage:\n"
+            "  %s [--size MB] [FILE...]   run every benchmark, FILEs are added to the corpus\n"
+            "  %s --codec [FILE...]       entropy, tree build, encode and decode per input\n"
+            "  %s --histogram[=MB]        the histogram kernels in GB/s\n"
+            "  %s --build                 the tree builders in ns per build\n"
+            "  %s --entropy               the exact and the fast entropy per 4 KiB block\n"
+            "  %s --tokens                count, build and coding of wide alphabets\n"
+            "  %s --service               1 KiB messages through the batching service\n"
+            "  %s --vectors               coding from and to scattered segments\n"
+            "\n"
+            "  --size MB       size of the generated inputs of --codec (default 16)\n",
+            program, program, program, program, program, program, program, program);
+}
+
+int main(int argc, char* argv[]) {
+    static const struct option long_options[] = {
+        { "codec", no_argument, NULL, 'c' },
+        { "histogram", optional_argument, NULL, 'g' },
+        { "build", no_argument, NULL, 'b' },
+        { "entropy", no_argument, NULL, 'e' },
+        { "tokens", no_argument, NULL, 't' },
+        { "service", no_argument, NULL, 'v' },
+        { "vectors", no_argument, NULL, 'V' },
+        { "size", required_argument, NULL, 's' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    int codec = 0, histogram = 0, build = 0, entropy = 0, tokens = 0, service = 0, vectors = 0;
+    size_t histogram_megabytes = 256, megabytes = 16;
+    int option;
+    while ((option = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (option) {
+        case 'c':
+            codec = 1;
+            break;
+        case 'g':
+            histogram = 1;
+            if (optarg) histogram_megabytes = (size_t)atoi(optarg);
+            break;
+        case 'b':
+            build = 1;
+            break;
+        case 'e':
+            entropy = 1;
+            break;
+        case 't':
+            tokens = 1;
+            break;
+        case 'v':
+            service = 1;
+            break;
+        case 'V':
+            vectors = 1;
+            break;
+        case 's':
+            megabytes = (size_t)atoi(optarg);
+            if (megabytes < 1) {
+                fprintf(stderr, "%s: --size must be at least 1\n", argv[0]);
+                return 1;
+            }
+            break;
+        case 'h':
+            print_usage(argv[0]);
+            return 0;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!codec && !histogram && !build && !entropy && !tokens && !service && !vectors) {
+        codec = histogram = build = entropy = tokens = service = vectors = 1;
+    }
+
+    int status = 0;
+    if (codec) status |= bench_codec(megabytes, argv + optind, argc - optind);
+    if (histogram) {
+        printf("\n");
+        status |= bench_histogram(histogram_megabytes);
+    }
+    if (build) {
+        printf("\n");
+        status |= bench_build();
+    }
+    if (entropy) {
+        printf("\n");
+        status |= bench_entropy();
+    }
+    if (tokens) {
+        printf("\n");
+        status |= bench_tokens();
+    }
+    if (service) {
+        printf("\n");
+        status |= bench_service();
+    }
+    if (vectors) {
+        printf("\n");
+        status |= bench_vectors();
+    }
+    return status;
+}
\ No newline at end of file
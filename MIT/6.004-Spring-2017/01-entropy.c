@@ -1,277 +1,1795 @@
 #include <stdio.h>
 #include <string.h>
-#include <math.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
-#define ASCII 256
+#include "util/entropy.h"
 
-char* huffman_codes_map[ASCII] = { 0 };
+#define STREAM_BLOCK_SIZE (1 << 20)
+// The streaming mode reads its input in blocks of 1 MiB, so the memory usage
+// doesn't depend on the size of input at all.
+#define MAX_JOBS 256
 
-typedef struct HuffmanNode {
-    char symbol;
-    double frequency;
-    struct HuffmanNode* left;
-    struct HuffmanNode* right;
-} HuffmanNode;
+#define CONTAINER_MAGIC "HUFF"
+#define CONTAINER_VERSION 3
+#define INDEX_MAGIC "HIDX"
+#define FILE_HEADER_SIZE 12
+#define INDEX_ENTRY_SIZE 12
+#define TRAILER_SIZE 16
+#define CONTAINER_LINKED 0x01
+// The flags byte of the file header, the blocks share tables (--reuse-tables)
+#define CONTAINER_DICTIONARY 0x02
+// The header is followed by the id (u32) of the dictionary the file needs
+#define DEFAULT_BLOCK_SIZE (128 << 10)
+#define MAX_BLOCK_SIZE (64 << 20)
+#define OUTPUT_BUFFER_SIZE (64 << 10)
+#define TOKEN_WORDS 1
+#define TOKEN_BUFFER_SIZE 4096
+#define CODE_STRING_SIZE (MAX_CODE_LENGTH + 1)
+// Every code string is copied with all CODE_STRING_SIZE bytes, see
+// format_encoding
+#ifndef IOV_MAX
+#define IOV_MAX 16
+// The least POSIX allows, limits.h only has the real one with _XOPEN_SOURCE
+#endif
 
+/**
+ * CodecOptions collects the command line options that change how the input is
+ * counted and coded.
+ */
 typedef struct {
-    int size;
-    int capacity;
-    HuffmanNode** data;
-    // data[i] is a pointer pointing to a HuffmanNode, this is pointers arithmetic
-    // data[0] points to the root of this min heap (or priority queue)
-} MinHeap;
+    int jobs;
+    int max_bits;
+    // 0 means the code lengths aren't limited
+    HuffmanBuilder builder;
+    size_t block_size;
+    int streams;
+    EntropyEngine engine;
+    int reuse_tables;
+    const char* dictionary_path;
+    const unsigned char* dictionary;
+    size_t dictionary_size;
+    // --dictionary FILE, main maps it
+    int use_mmap;
+    size_t window;
+    double threshold;
+    // --window mode reports where the entropy of window bytes > threshold
+    int tokens;
+    // --tokens mode: 16 or 32 for little endian tokens, or TOKEN_WORDS
+    long block;
+    // block >= 0 only decodes that block
+    const char* output_path;
+} CodecOptions;
+
+/**
+ * format_code function writes a code as a string of '0' and '1', out must have
+ * room for MAX_CODE_LENGTH + 1 chars.
+ */
+void format_code(HuffmanCode code, char out[]) {
+    for (int i = 0; i < code.length; ++i) {
+        out[i] = '0' + ((code.bits >> (code.length - 1 - i)) & 1);
+    }
+    out[code.length] = '\0';
+}
+
+/**
+ * print_symbol function prints a symbol of the Huffman map, the bytes that
+ * can't be printed (like '\n' or '\0' in binary data) are printed as \xNN.
+ */
+void print_symbol(unsigned char symbol) {
+    if (isprint(symbol)) {
+        printf("%c", symbol);
+    } else {
+        printf("\\x%02x", symbol);
+    }
+}
+
+/**
+ * print_huffman_summary function only needs the statistics, the total bits of
+ * encoding result is ∑ [tᵢ * len(codeᵢ)] so it doesn't walk the input again.
+ */
+void print_huffman_summary(const SymbolStats* stats, const HuffmanCode table[]) {
+    double average_length = 0.0;
+    uint64_t bits = 0;
+    for (int i = 0; i < stats->count; ++i) {
+        unsigned char symbol = stats->kind[i];
+        int code_length = table[symbol].length;
+        average_length += (double)stats->appear_times[symbol] / stats->length * code_length;
+        bits += stats->appear_times[symbol] * code_length;
+    }
+    printf("Huffman Average Length:     %.4f bits\n", average_length);
+    printf("Huffman Encoding Bits:      %.4f bits\n", (double)bits);
+}
 
-MinHeap* create_heap(int capacity) {
-    MinHeap* heap = (MinHeap*)malloc(sizeof(MinHeap));
-    // sizeof(MinHeap) is a fixed constant and the operations on HuffmanNode
-    // don't affect the memory of heap
-    heap->size = 0;
-    heap->capacity = capacity;
-    heap->data = (HuffmanNode**)malloc(capacity * sizeof(HuffmanNode*));
-    return heap;
+void print_huffman_map(const SymbolStats* stats, const HuffmanCode table[]) {
+    char path[MAX_CODE_LENGTH + 1];
+    printf("Huffman Map: \n");
+    for (int i = 0; i < stats->count; ++i) {
+        printf("  ");
+        print_symbol(stats->kind[i]);
+        format_code(table[stats->kind[i]], path);
+        printf(" → %s\n", path);
+    }
 }
 
 /**
- * swap function is used to swap two huffman nodes in heapify function
+ * format_code_strings function formats the code of every appeared symbol once,
+ * so the coding result is only copies of these strings.
  */
-void swap(HuffmanNode** a, HuffmanNode** b) {
-    HuffmanNode* temp = *a;
-    *a = *b;
-    *b = temp;
+void format_code_strings(const SymbolStats* stats, const HuffmanCode table[], char code_strings[][CODE_STRING_SIZE]) {
+    for (int i = 0; i < stats->count; ++i) {
+        format_code(table[stats->kind[i]], code_strings[stats->kind[i]]);
+    }
 }
 
 /**
- * heapify function operates from position i to bottom unless the parent node has
- * been less than its two children nodes.
+ * format_encoding function writes the coding result of data to out as '0' and
+ * '1' chars and returns how many it wrote. The length of every code comes from
+ * table, so nothing is counted with strlen. Every symbol copies the whole
+ * CODE_STRING_SIZE bytes of its string (a fixed size memcpy is a few vector
+ * stores instead of a call) and then only moves out by the code length, the
+ * next symbol overwrites the rest:
  *
- *             [i]
- *            /   \
- *      [2i+1]     [2i+2]
+ *   out   1 0 1 \0 ? ? ...      "101" copied with its 64 bytes
+ *         1 0 1 0 0 \0 ? ...    "00" copied right after the 3rd char
  *
- * smallest ← index of min([i].f, [2i+1].f, [2i+2].f)
- * swap smallest and i, it only ensure every parent node is less than its children 
- * nodes
+ * So out needs CODE_STRING_SIZE bytes more than the result, see
+ * encoding_buffer_size.
  */
-void heapify(MinHeap* heap, int i) {
-    int smallest = i;
-    int l = 2 * i + 1;
-    int r = 2 * i + 2;
-    if (l < heap->size && heap->data[l]->frequency < heap->data[smallest]->frequency)
-        smallest = l;
-    if (r < heap->size && heap->data[r]->frequency < heap->data[smallest]->frequency)
-        smallest = r;
-    // First check which one is the smallest
-    if (smallest != i) {
-        swap(&heap->data[i], &heap->data[smallest]);
-        heapify(heap, smallest);
+size_t format_encoding(const unsigned char* data, size_t length, const HuffmanCode table[],
+                       const char code_strings[][CODE_STRING_SIZE], unsigned char* out) {
+    unsigned char* start = out;
+    for (size_t i = 0; i < length; ++i) {
+        unsigned char symbol = data[i];
+        memcpy(out, code_strings[symbol], CODE_STRING_SIZE);
+        out += table[symbol].length;
     }
+    return out - start;
+}
+
+size_t encoding_buffer_size(size_t length, int max_length) {
+    return length * (size_t)max_length + CODE_STRING_SIZE;
 }
 
 /**
- * heap_insert functions is also a kind of heapify but it's from bottom up!
+ * print_huffman_encoding function prints the coding result of data through a
+ * buffer of OUTPUT_BUFFER_SIZE bytes, one fwrite per full buffer instead of
+ * one printf per symbol.
  */
-void heap_insert(MinHeap* heap, HuffmanNode* node) {
-    int i = heap->size++;
-    heap->data[i] = node;
+void print_huffman_encoding(const SymbolStats* stats, const unsigned char* data, const HuffmanCode table[]) {
+    char code_strings[ASCII][CODE_STRING_SIZE];
+    unsigned char buffer[OUTPUT_BUFFER_SIZE];
+    size_t step = (OUTPUT_BUFFER_SIZE - CODE_STRING_SIZE) / MAX_CODE_LENGTH;
+    // Symbols per buffer, even if every code were MAX_CODE_LENGTH bits
+    format_code_strings(stats, table, code_strings);
+    for (size_t i = 0; i < stats->length; i += step) {
+        size_t n = stats->length - i < step ? stats->length - i : step;
+        fwrite(buffer, 1, format_encoding(data + i, n, table, (const char (*)[CODE_STRING_SIZE])code_strings, buffer),
+               stdout);
+    }
+}
 
-    while (i && heap->data[(i - 1) / 2]->frequency > heap->data[i]->frequency) {
-        // No matter i is left leaf or right leaf, [(i - 1) / 2] is always [i]'s
-        // parent node.
-        swap(&heap->data[i], &heap->data[(i - 1) / 2]);
-        i = (i - 1) / 2;
+/**
+ * write_vectors function writes count buffers to out with writev, so a whole
+ * batch of blocks is one syscall and nothing is copied into stdio's buffer.
+ * What stdio still holds is flushed first to keep the order of the output.
+ * vectors is used up as it's written. It returns the number of bytes written,
+ * or -1 on a write error.
+ */
+ssize_t write_vectors(FILE* out, struct iovec* vectors, int count) {
+    if (fflush(out) != 0) return -1;
+    int fd = fileno(out);
+    ssize_t total = 0;
+    while (count > 0) {
+        ssize_t written = writev(fd, vectors, count < IOV_MAX ? count : IOV_MAX);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        total += written;
+        while (count > 0 && (size_t)written >= vectors->iov_len) {
+            written -= vectors->iov_len;
+            vectors++;
+            count--;
+        }
+        if (count > 0) {
+            vectors->iov_base = (char*)vectors->iov_base + written;
+            vectors->iov_len -= written;
+            // A short write, the rest of this buffer goes in the next call
+        }
     }
+    return total;
+}
+
+void print_huffman_result(const SymbolStats* stats, const unsigned char* input) {
+    HuffmanCode table[ASCII];
+    if (stats->length == 0) return;
+
+    build_huffman_codes(stats, BUILDER_HEAP, 0, table);
+    print_huffman_summary(stats, table);
+
+    printf("Huffman Encoding Result:    ");
+    STATS_BEGIN(start);
+    print_huffman_encoding(stats, input, table);
+    STATS_END(start, STATS_ENCODE, stats->length);
+    printf("\n");
+
+    print_huffman_map(stats, table);
 }
 
 /**
- * heap_extract_min function pops the root of min heap, and change heap size,
- * change pointing position of heap[0] to the last element and heapify.
+ * ChunkJob is the work of one thread on one block of a batch. In the counting
+ * pass every thread fills its own appear_times, so no counter is shared and
+ * no lock is needed; they are merged into the SymbolStats after the join. In
+ * the encoding pass every thread writes the coding result of its block to its
+ * own output buffer, and the buffers are written out in block order.
  */
-HuffmanNode* heap_extract_min(MinHeap* heap) {
-    HuffmanNode* root = heap->data[0];
-    heap->data[0] = heap->data[--heap->size];
-    heapify(heap, 0);
-    return root;
+typedef struct {
+    const unsigned char* data;
+    size_t length;
+    uint64_t appear_times[ASCII];
+    const HuffmanCode* codes;
+    const char (*code_strings)[CODE_STRING_SIZE];
+    EntropyEncoder* encoder;
+    unsigned char* output;
+    size_t output_length;
+} ChunkJob;
+
+void* count_chunk(void* arg) {
+    ChunkJob* job = (ChunkJob*)arg;
+    memset(job->appear_times, 0, sizeof(job->appear_times));
+    histogram_count(job->data, job->length, job->appear_times);
+    return NULL;
 }
 
-HuffmanNode* create_huffman_node(char symbol, double frequency) {
-    HuffmanNode* node = (HuffmanNode*)malloc(sizeof(HuffmanNode));
-    node->symbol = symbol;
-    node->frequency = frequency;
-    node->left = node->right = NULL;
-    return node;
+void* encode_chunk(void* arg) {
+    ChunkJob* job = (ChunkJob*)arg;
+    STATS_BEGIN(start);
+    job->output_length = format_encoding(job->data, job->length, job->codes, job->code_strings, job->output);
+    STATS_END(start, STATS_ENCODE, job->length);
+    return NULL;
 }
 
 /**
- * Every node of min heap is a sub-binary-tree consisting of HuffmanNode. When
- * inserting back the reduction HuffmanNode (which is `w` in the following code),
- * it also compares with remaining nodes.
+ * run_jobs function runs task on count jobs of job_size bytes each, jobs[0]
+ * runs on the calling thread so `-j 1` never creates a thread.
+ */
+int run_jobs(void* (*task)(void*), void* jobs, size_t job_size, int count) {
+    pthread_t threads[MAX_JOBS];
+    char* base = (char*)jobs;
+    int started = 1;
+    for (; started < count; ++started) {
+        if (pthread_create(&threads[started], NULL, task, base + started * job_size) != 0) break;
+    }
+    task(base);
+    for (int i = 1; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = started; i < count; ++i) {
+        task(base + i * job_size);
+        // pthread_create failed, so the rest is done here
+    }
+    return 0;
+}
+
+#define SCHEDULER_WINDOW 2
+// Blocks in flight per thread: the one being coded and the next one
+
+/**
+ * Scheduler runs the block tasks of compress_file and decompress_file on a
+ * pool of threads. A task codes one slot, and the slots are given to the
+ * threads round robin, every thread has its own deque of them. A thread whose
+ * deque is empty steals from the deques of the others, so a thread stuck on
+ * an expensive tANS block doesn't leave the cheap raw blocks behind it
+ * waiting while the other threads idle:
+ *
+ *     reader ──submit──> [deque 0] [deque 1] ... [deque N-1]
+ *                            │    <──steal──>    │
+ *                        thread 0   thread 1 ... thread N-1
+ *                            │                   │
+ *                            └──> finished[slot] <┘ ──> writer, in order
  *
- * => [A, B, C, D]
- * => [A, B, (C,D)]
- * => [B, ((C,D),A)]
- * => [(((C,D),A),B)]
+ * There are SCHEDULER_WINDOW slots per thread and the caller submits a slot
+ * again only after writing it, so the memory is a fixed number of blocks
+ * however big the input is. The owner and the thieves both take the oldest
+ * slot of a deque, since the writer waits for the blocks in order.
  *
- * so when the size of heap comes to 1, there is only a Huffman tree in this
- * heap!
+ * With one thread there's no pool: scheduler_submit runs the task right away
+ * on the calling thread, so `-j 1` still never creates a thread and the blocks
+ * of a linked file go through one coder in order.
  */
-HuffmanNode* build_huffman(const char* symbols, double frequencies[], int n) {
-    MinHeap* heap = create_heap(n);
+typedef void (*SchedulerTask)(void* context, void* slot, int thread);
 
-    for (int i = 0; i < n; ++i) {
-        heap_insert(heap, create_huffman_node(symbols[i], frequencies[i]));
-    }
+typedef struct {
+    int* slots;
+    int head, count;
+    pthread_mutex_t lock;
+} TaskDeque;
 
-    while (heap->size > 1) {
-        HuffmanNode* u = heap_extract_min(heap);
-        HuffmanNode* v = heap_extract_min(heap);
+typedef struct Scheduler Scheduler;
 
-        HuffmanNode* w = create_huffman_node('\0', u->frequency + v->frequency);
-        w->left = u;
-        w->right = v;
+typedef struct {
+    Scheduler* scheduler;
+    int index;
+    pthread_t thread;
+} SchedulerThread;
+
+struct Scheduler {
+    SchedulerTask task;
+    void* context;
+    char* slots;
+    size_t slot_size;
+    int slots_count;
+    int threads_count;
+    int started;
+    // 0 when the tasks run on the calling thread
+    int next;
+    // Deque of the next submit
+    int queued;
+    // Submitted tasks no thread has claimed yet
+    int stopping;
+    unsigned char* finished;
+    SchedulerThread threads[MAX_JOBS];
+    TaskDeque deques[MAX_JOBS];
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+};
 
-        heap_insert(heap, w);
+/**
+ * scheduler_take function takes the oldest slot of the deque of thread index,
+ * or steals one from the next deque that has any. A thread only calls it
+ * after claiming one of the queued tasks, so there's always one to find.
+ */
+int scheduler_take(Scheduler* scheduler, int index) {
+    for (int k = 0;; k = (k + 1) % scheduler->started) {
+        TaskDeque* deque = &scheduler->deques[(index + k) % scheduler->started];
+        int slot = -1;
+        pthread_mutex_lock(&deque->lock);
+        if (deque->count > 0) {
+            slot = deque->slots[deque->head];
+            deque->head = (deque->head + 1) % scheduler->slots_count;
+            deque->count--;
+        }
+        pthread_mutex_unlock(&deque->lock);
+        if (slot >= 0) return slot;
     }
+}
+
+void* scheduler_thread(void* arg) {
+    SchedulerThread* thread = (SchedulerThread*)arg;
+    Scheduler* scheduler = thread->scheduler;
+    for (;;) {
+        pthread_mutex_lock(&scheduler->lock);
+        while (scheduler->queued == 0 && !scheduler->stopping) {
+            pthread_cond_wait(&scheduler->work, &scheduler->lock);
+        }
+        if (scheduler->queued == 0) {
+            pthread_mutex_unlock(&scheduler->lock);
+            return NULL;
+        }
+        scheduler->queued--;
+        pthread_mutex_unlock(&scheduler->lock);
 
-    return heap_extract_min(heap);
+        int slot = scheduler_take(scheduler, thread->index);
+        scheduler->task(scheduler->context, scheduler->slots + slot * scheduler->slot_size, thread->index);
+        pthread_mutex_lock(&scheduler->lock);
+        scheduler->finished[slot] = 1;
+        pthread_cond_broadcast(&scheduler->done);
+        pthread_mutex_unlock(&scheduler->lock);
+    }
 }
 
 /**
- * huffman_code function will store the map between symbols and coding result.
+ * scheduler_start function starts threads_count threads running task on the
+ * slots_count slots of slot_size bytes each. If no thread can be created the
+ * tasks run on the calling thread, if some can the pool is smaller.
  */
-void huffman_code(HuffmanNode* root, char path[], int depth, char* table[]) {
-    if (!root) return;
+int scheduler_start(Scheduler* scheduler, int threads_count, SchedulerTask task, void* context, void* slots,
+                    size_t slot_size, int slots_count) {
+    memset(scheduler, 0, sizeof(Scheduler));
+    scheduler->task = task;
+    scheduler->context = context;
+    scheduler->slots = (char*)slots;
+    scheduler->slot_size = slot_size;
+    scheduler->slots_count = slots_count;
+    scheduler->threads_count = threads_count;
+    scheduler->finished = (unsigned char*)calloc(slots_count, 1);
+    if (!scheduler->finished) return -1;
+    pthread_mutex_init(&scheduler->lock, NULL);
+    pthread_cond_init(&scheduler->work, NULL);
+    pthread_cond_init(&scheduler->done, NULL);
+    if (threads_count == 1) return 0;
 
-    if (!root->left && !root->right) {
-        // When there is no children nodes
-        path[depth] = '\0';
-        table[(unsigned char)root->symbol] = strdup(path);
-        // Notice path is a shared cache for every coding result of symbols. If
-        // we store the pointer then every coding result is same !
+    for (int t = 0; t < threads_count; ++t) {
+        scheduler->deques[t].slots = (int*)malloc(slots_count * sizeof(int));
+        if (!scheduler->deques[t].slots) return -1;
+        pthread_mutex_init(&scheduler->deques[t].lock, NULL);
+    }
+    for (; scheduler->started < threads_count; ++scheduler->started) {
+        SchedulerThread* thread = &scheduler->threads[scheduler->started];
+        thread->scheduler = scheduler;
+        thread->index = scheduler->started;
+        if (pthread_create(&thread->thread, NULL, scheduler_thread, thread) != 0) break;
+    }
+    return 0;
+}
+
+void scheduler_submit(Scheduler* scheduler, int slot) {
+    if (scheduler->started == 0) {
+        scheduler->task(scheduler->context, scheduler->slots + slot * scheduler->slot_size, 0);
+        scheduler->finished[slot] = 1;
         return;
     }
+    TaskDeque* deque = &scheduler->deques[scheduler->next];
+    scheduler->next = (scheduler->next + 1) % scheduler->started;
+    pthread_mutex_lock(&deque->lock);
+    deque->slots[(deque->head + deque->count) % scheduler->slots_count] = slot;
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->queued++;
+    pthread_cond_signal(&scheduler->work);
+    pthread_mutex_unlock(&scheduler->lock);
+}
 
-    path[depth] = '0';
-    huffman_code(root->left, path, depth + 1, table);
+/**
+ * scheduler_collect function waits (if wait is set) until the task of slot is
+ * finished. It returns 1 and makes the slot free to submit again when it's
+ * finished, or 0.
+ */
+int scheduler_collect(Scheduler* scheduler, int slot, int wait) {
+    if (scheduler->started == 0) {
+        int finished = scheduler->finished[slot];
+        scheduler->finished[slot] = 0;
+        return finished;
+    }
+    pthread_mutex_lock(&scheduler->lock);
+    while (wait && !scheduler->finished[slot]) pthread_cond_wait(&scheduler->done, &scheduler->lock);
+    int finished = scheduler->finished[slot];
+    scheduler->finished[slot] = 0;
+    pthread_mutex_unlock(&scheduler->lock);
+    return finished;
+}
 
-    path[depth] = '1';
-    huffman_code(root->right, path, depth + 1, table);
+/**
+ * scheduler_stop function lets the threads finish the submitted tasks and
+ * joins them, so the slots can be freed after it.
+ */
+void scheduler_stop(Scheduler* scheduler) {
+    if (!scheduler->finished) return;
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->stopping = 1;
+    pthread_cond_broadcast(&scheduler->work);
+    pthread_mutex_unlock(&scheduler->lock);
+    for (int t = 0; t < scheduler->started; ++t) {
+        pthread_join(scheduler->threads[t].thread, NULL);
+    }
+    for (int t = 0; t < scheduler->threads_count; ++t) {
+        if (scheduler->deques[t].slots) pthread_mutex_destroy(&scheduler->deques[t].lock);
+        free(scheduler->deques[t].slots);
+    }
+    pthread_mutex_destroy(&scheduler->lock);
+    pthread_cond_destroy(&scheduler->work);
+    pthread_cond_destroy(&scheduler->done);
+    free(scheduler->finished);
+    scheduler->finished = NULL;
 }
 
-void print_huffman_result(const char* input) {
-    int length = strlen(input);
-    if (length == 0) return;
+/**
+ * StreamInput is an input read block by block, with `-j N` a batch of N blocks
+ * is read at once and every block is handled by its own thread, so only N
+ * blocks live in memory at any moment.
+ *
+ * When two_pass is set the input can be read a second time with
+ * stream_rewind. stdin can't be read twice, so in the first pass every batch
+ * is also copied to a temporary file, which is read in the second pass.
+ *
+ * A regular file (also a file redirected to stdin) is mapped into memory
+ * instead: the jobs point straight into the page cache, so there's no copy
+ * to the batch buffer and no read syscall, and the second pass is only a
+ * reset of the offset. MADV_SEQUENTIAL lets the kernel read ahead
+ * aggressively and drop the pages behind us. Pipes and ttys, or `--no-mmap`,
+ * still go through fread.
+ */
+typedef struct {
+    const char* path;
+    FILE* input;
+    FILE* current;
+    FILE* spool;
+    unsigned char* batch;
+    const unsigned char* map;
+    size_t map_size;
+    size_t map_offset;
+    size_t block_size;
+    ChunkJob* jobs;
+    int jobs_count;
+} StreamInput;
+
+/**
+ * stream_map function tries to map the whole input, it returns 0 if the input
+ * isn't a non-empty regular file or can't be mapped, so fread is used.
+ */
+int stream_map(StreamInput* stream) {
+    struct stat info;
+    int fd = fileno(stream->input);
+    if (fstat(fd, &info) < 0 || !S_ISREG(info.st_mode) || info.st_size <= 0) return 0;
+    off_t start = ftello(stream->input);
+    if (start < 0 || start >= info.st_size) return 0;
+    // stdin may have been read partly by someone else before us
 
-    int count = 0;
-    int appear_times[ASCII] = { 0 };
-    double appear_frequencies[ASCII] = { 0.0 };
-    char kind[ASCII];
-    char path[ASCII];
+    void* map = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) return 0;
+    madvise(map, (size_t)info.st_size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    madvise(map, (size_t)info.st_size, MADV_HUGEPAGE);
+    // Only taken by kernels with huge pages for the page cache, fine to fail
+#endif
+    stream->map = (const unsigned char*)map;
+    stream->map_size = (size_t)info.st_size;
+    stream->map_offset = (size_t)start;
+    return 1;
+}
 
-    for (int i = 0; i < length; ++i) {
-        appear_times[(unsigned char)input[i]]++;
-        if (appear_times[(unsigned char)input[i]] == 1) {
-            kind[count] = input[i];
-            count++;
+int stream_open(StreamInput* stream, const char* path, const CodecOptions* options, size_t block_size, int two_pass) {
+    int jobs_count = options->jobs;
+    memset(stream, 0, sizeof(StreamInput));
+    stream->path = path;
+    stream->jobs_count = jobs_count;
+    stream->block_size = block_size;
+    int from_stdin = strcmp(path, "-") == 0;
+    stream->input = from_stdin ? stdin : fopen(path, "rb");
+    if (!stream->input) {
+        perror(path);
+        return -1;
+    }
+    stream->current = stream->input;
+    if (options->use_mmap && stream_map(stream)) {
+        stream->jobs = (ChunkJob*)calloc(jobs_count, sizeof(ChunkJob));
+        if (!stream->jobs) {
+            perror("malloc");
+            return -1;
         }
+        return 0;
+    }
+    stream->spool = from_stdin && two_pass ? tmpfile() : NULL;
+    if (from_stdin && two_pass && !stream->spool) {
+        perror("tmpfile");
+        return -1;
+    }
+    stream->batch = (unsigned char*)malloc((size_t)jobs_count * block_size);
+    stream->jobs = (ChunkJob*)calloc(jobs_count, sizeof(ChunkJob));
+    if (!stream->batch || !stream->jobs) {
+        perror("malloc");
+        return -1;
     }
+    return 0;
+}
 
-    for (int i = 0; i < ASCII; ++i) {
-        appear_frequencies[i] = (double)appear_times[i] / length;
+void stream_close(StreamInput* stream) {
+    if (stream->jobs) {
+        for (int j = 0; j < stream->jobs_count; ++j) {
+            free(stream->jobs[j].output);
+            entropy_encoder_destroy(stream->jobs[j].encoder);
+        }
     }
+    free(stream->jobs);
+    free(stream->batch);
+    if (stream->map) munmap((void*)stream->map, stream->map_size);
+    if (stream->spool) fclose(stream->spool);
+    if (stream->input && stream->input != stdin) fclose(stream->input);
+}
 
-    HuffmanNode* root = build_huffman(kind, appear_frequencies, count);
-    huffman_code(root, path, 0, huffman_codes_map);
+/**
+ * stream_next_batch function reads up to jobs_count blocks at once and gives
+ * every job one block of it. It returns the number of jobs that got data.
+ */
+int stream_next_batch(StreamInput* stream, size_t* read) {
+    size_t block_size = stream->block_size;
+    size_t batch_size = (size_t)stream->jobs_count * block_size;
+    const unsigned char* batch;
+    if (stream->map) {
+        size_t left = stream->map_size - stream->map_offset;
+        *read = left < batch_size ? left : batch_size;
+        batch = stream->map + stream->map_offset;
+        stream->map_offset += *read;
+    } else {
+        *read = fread(stream->batch, 1, batch_size, stream->current);
+        batch = stream->batch;
+    }
+    int used = 0;
+    for (size_t offset = 0; offset < *read; offset += block_size) {
+        stream->jobs[used].data = batch + offset;
+        stream->jobs[used].length = (*read - offset) < block_size ? (*read - offset) : block_size;
+        used++;
+    }
+    return used;
+}
 
-    double average_length = 0.0;
-    for (int i = 0; i < count; ++i) {
-        average_length += appear_frequencies[kind[i]] * strlen(huffman_codes_map[kind[i]]);
+/**
+ * stream_next_block function gives job the next block of the input, read to
+ * buffer unless the input is mapped. It returns 0 at the end of the input.
+ */
+int stream_next_block(StreamInput* stream, ChunkJob* job, unsigned char* buffer) {
+    size_t block_size = stream->block_size;
+    if (stream->map) {
+        size_t left = stream->map_size - stream->map_offset;
+        job->data = stream->map + stream->map_offset;
+        job->length = left < block_size ? left : block_size;
+        stream->map_offset += job->length;
+    } else {
+        job->data = buffer;
+        job->length = fread(buffer, 1, block_size, stream->current);
     }
-    printf("Huffman Average Length:     %.4f bits\n", average_length);
+    return job->length > 0;
+}
 
-    int bits = 0;
-    for (int i = 0; i < length; ++i) {
-        bits += strlen(huffman_codes_map[input[i]]);
+/**
+ * stream_count function is the first pass, it fills stats from the whole input.
+ */
+int stream_count(StreamInput* stream, SymbolStats* stats) {
+    size_t n;
+    int used;
+
+    symbol_stats_init(stats);
+    size_t start = stream->map_offset;
+    while ((used = stream_next_batch(stream, &n)) > 0) {
+        run_jobs(count_chunk, stream->jobs, sizeof(ChunkJob), used);
+        for (int j = 0; j < used; ++j) {
+            for (int i = 0; i < ASCII; ++i) {
+                stats->appear_times[i] += stream->jobs[j].appear_times[i];
+            }
+        }
+        stats->length += n;
+        if (stream->spool && fwrite(stream->batch, 1, n, stream->spool) != n) {
+            perror("tmpfile");
+            return -1;
+        }
     }
-    printf("Huffman Encoding Bits:      %.4f bits\n", (double)bits);
+    if (ferror(stream->input)) {
+        perror(stream->path);
+        return -1;
+    }
+    symbol_stats_finish(stats);
+    stream->map_offset = start;
+    // The second pass of a mapping starts over from the same place
+    return 0;
+}
 
+/**
+ * stream_alloc_outputs function gives every job an output buffer of
+ * output_size bytes.
+ */
+int stream_alloc_outputs(StreamInput* stream, size_t output_size) {
+    for (int j = 0; j < stream->jobs_count; ++j) {
+        stream->jobs[j].output = (unsigned char*)malloc(output_size);
+        if (!stream->jobs[j].output) {
+            perror("malloc");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * stream_rewind function starts the second pass.
+ */
+void stream_rewind(StreamInput* stream) {
+    if (stream->map) return;
+    // stream_count has already reset the offset
+    stream->current = stream->spool ? stream->spool : stream->input;
+    rewind(stream->current);
+}
+
+/**
+ * stream_huffman_result function handles inputs of any size with two passes:
+ *
+ * 1. read the input block by block and build the statistics incrementally,
+ * 2. build the Huffman codes, print the statistics and the code table first,
+ *    then read the input again block by block and print the coding result.
+ */
+int stream_huffman_result(const char* path, const CodecOptions* options) {
+    StreamInput stream;
+    SymbolStats stats;
+    int status = 1;
+
+    if (stream_open(&stream, path, options, STREAM_BLOCK_SIZE, 1) < 0 ||
+        stream_count(&stream, &stats) < 0) goto done;
+
+    printf("Input Bytes:                %llu\n", (unsigned long long)stats.length);
+    printf("Information Entropy:        %.4f bits\n", information_entropy(&stats));
+    printf("Information Value:          %.4f bits\n", information_value(&stats));
+    if (stats.length == 0) {
+        status = 0;
+        goto done;
+    }
+
+    HuffmanCode table[ASCII];
+    if (build_huffman_codes(&stats, options->builder, options->max_bits, table) < 0) {
+        fprintf(stderr, "%s: %d symbols don't fit in codes of %d bits\n", path, stats.count,
+                options->max_bits ? options->max_bits : MAX_CODE_LENGTH);
+        goto done;
+    }
+    print_huffman_summary(&stats, table);
+    print_huffman_map(&stats, table);
+
+    char code_strings[ASCII][CODE_STRING_SIZE];
+    format_code_strings(&stats, table, code_strings);
+    for (int j = 0; j < options->jobs; ++j) {
+        stream.jobs[j].codes = table;
+        stream.jobs[j].code_strings = (const char (*)[CODE_STRING_SIZE])code_strings;
+    }
+
+    if (stream_alloc_outputs(&stream, encoding_buffer_size(STREAM_BLOCK_SIZE, max_code_length(&stats, table))) < 0)
+        goto done;
+    stream_rewind(&stream);
     printf("Huffman Encoding Result:    ");
-    for (int i = 0; i < length; ++i) {
-        printf("%s", huffman_codes_map[input[i]]);
+    size_t n;
+    int used;
+    while ((used = stream_next_batch(&stream, &n)) > 0) {
+        run_jobs(encode_chunk, stream.jobs, sizeof(ChunkJob), used);
+        struct iovec vectors[MAX_JOBS];
+        for (int j = 0; j < used; ++j) {
+            vectors[j].iov_base = stream.jobs[j].output;
+            vectors[j].iov_len = stream.jobs[j].output_length;
+        }
+        STATS_BEGIN(start);
+        ssize_t written = write_vectors(stdout, vectors, used);
+        if (written < 0) {
+            perror("stdout");
+            goto done;
+        }
+        STATS_END(start, STATS_OUTPUT, written);
     }
     printf("\n");
+    status = 0;
 
-    printf("Huffman Map: \n");
-    for (int i = 0; i < count; ++i) {
-        printf("  %c → %s\n", kind[i], huffman_codes_map[kind[i]]);
+done:
+    stream_close(&stream);
+    return status;
+}
+
+/**
+ * context_entropy_result function prints the order-0, order-1 and order-2
+ * entropy of a file. Text, logs and tables usually have a much lower order-1
+ * or order-2 entropy than order-0, that's how much a context model could
+ * still save over the Huffman codes here.
+ */
+int context_entropy_result(const char* path, const CodecOptions* options) {
+    CodecOptions sequential = *options;
+    sequential.jobs = 1;
+    // The contexts run across block boundaries, so one block at a time
+    StreamInput stream = { 0 };
+    Order1Stats* order1 = (Order1Stats*)malloc(sizeof(Order1Stats));
+    Order2Stats order2 = { 0 };
+    uint64_t appear_times[ASCII] = { 0 };
+    int status = 1;
+
+    if (!order1 || order1_stats_init(order1) < 0 || order2_stats_init(&order2) < 0) {
+        perror("malloc");
+        goto done;
+    }
+    if (stream_open(&stream, path, &sequential, STREAM_BLOCK_SIZE, 0) < 0) goto done;
+    size_t n;
+    while (stream_next_batch(&stream, &n) > 0) {
+        const unsigned char* data = stream.jobs[0].data;
+        histogram_count(data, n, appear_times);
+        order1_stats_update(order1, data, n);
+        if (order2_stats_update(&order2, data, n) < 0) {
+            perror("malloc");
+            goto done;
+        }
+    }
+    if (ferror(stream.input)) {
+        perror(path);
+        goto done;
     }
+
+    printf("Input Bytes:                %llu\n", (unsigned long long)order1->length);
+    printf("Order-0 Entropy:            %.4f bits\n", information_entropy_fast(appear_times, order1->length));
+    printf("Order-1 Entropy:            %.4f bits\n", order1_entropy(order1));
+    printf("Order-2 Entropy:            %.4f bits\n", order2_entropy(&order2));
+    status = 0;
+
+done:
+    if (order1) order1_stats_free(order1);
+    free(order1);
+    order2_stats_free(&order2);
+    stream_close(&stream);
+    return status;
 }
 
-/* calculate the information entropy of a string using Shannon formula. It doesn't
- * calculate its frequency in ASCII characters set though.
+/**
+ * rolling_entropy_result function prints the regions of a file where the
+ * entropy of the last `window` bytes goes above the threshold, like the
+ * encrypted or already compressed parts of a plain text stream:
+ *
+ *          start            end   max entropy
+ *          81920         147455        7.9977
+ *
+ * A region goes from the start of the first window above the threshold to
+ * the end of the last one. Only full windows are checked.
+ */
+int rolling_entropy_result(const char* path, const CodecOptions* options) {
+    CodecOptions sequential = *options;
+    sequential.jobs = 1;
+    StreamInput stream = { 0 };
+    RollingEntropy rolling;
+    int status = 1;
+
+    if (rolling_entropy_init(&rolling, options->window) < 0) {
+        fprintf(stderr, "%s: can't allocate a window of %zu bytes\n", path, options->window);
+        goto done;
+    }
+    if (stream_open(&stream, path, &sequential, STREAM_BLOCK_SIZE, 0) < 0) goto done;
+
+    printf("%14s %14s %13s\n", "start", "end", "max entropy");
+    uint64_t offset = 0, start = 0;
+    int inside = 0;
+    double peak = 0.0;
+    size_t n;
+    while (stream_next_batch(&stream, &n) > 0) {
+        const unsigned char* data = stream.jobs[0].data;
+        for (size_t i = 0; i < n; ++i, ++offset) {
+            rolling_entropy_push(&rolling, data[i]);
+            if (rolling.filled < rolling.window) continue;
+            double entropy = rolling_entropy_value(&rolling);
+            if (entropy > options->threshold) {
+                if (!inside) {
+                    inside = 1;
+                    start = offset + 1 - rolling.window;
+                    peak = 0.0;
+                }
+                if (entropy > peak) peak = entropy;
+            } else if (inside) {
+                inside = 0;
+                printf("%14llu %14llu %13.4f\n", (unsigned long long)start, (unsigned long long)offset - 1, peak);
+            }
+        }
+    }
+    if (inside) printf("%14llu %14llu %13.4f\n", (unsigned long long)start, (unsigned long long)offset - 1, peak);
+    if (ferror(stream.input)) {
+        perror(path);
+        goto done;
+    }
+    status = 0;
+
+done:
+    rolling_entropy_free(&rolling);
+    stream_close(&stream);
+    return status;
+}
+
+/**
+ * token_entropy_result function is stream_huffman_result for an alphabet of
+ * tokens instead of bytes: 16-bit or 32-bit little endian integers, or the
+ * words of a text (split at white space and hashed to 32-bit ids with
+ * FNV-1a, so a collision merges two words, rare below 10⁵ of them). The
+ * tokens are counted in a WideStats and only the summary is printed, a code
+ * table of 10⁵ symbols wouldn't be read by anyone.
+ */
+int token_entropy_result(const char* path, const CodecOptions* options) {
+    CodecOptions sequential = *options;
+    sequential.jobs = 1;
+    // A token can cross the end of a block
+    StreamInput stream = { 0 };
+    WideStats stats;
+    HuffmanCode* codes = NULL;
+    uint32_t tokens[TOKEN_BUFFER_SIZE];
+    size_t buffered = 0;
+    int status = 1;
+
+    if (wide_stats_init(&stats, options->tokens == 16 ? 1u << 16 : 1ull << 32) < 0) {
+        perror("malloc");
+        return 1;
+    }
+    if (stream_open(&stream, path, &sequential, STREAM_BLOCK_SIZE, 0) < 0) goto done;
+
+    int width = options->tokens == TOKEN_WORDS ? 0 : options->tokens / 8;
+    uint32_t token = 0;
+    int filled = 0;
+    // The bytes of the token so far, or the word hashed so far (filled = 1)
+    size_t n;
+    while (stream_next_batch(&stream, &n) > 0) {
+        const unsigned char* data = stream.jobs[0].data;
+        for (size_t i = 0; i < n; ++i) {
+            int complete = 0;
+            if (width) {
+                token |= (uint32_t)data[i] << (8 * filled);
+                complete = ++filled == width;
+            } else if (!isspace(data[i])) {
+                if (!filled) token = 2166136261u;
+                token = (token ^ data[i]) * 16777619u;
+                filled = 1;
+            } else {
+                complete = filled;
+            }
+            if (!complete) continue;
+            tokens[buffered++] = token;
+            token = 0;
+            filled = 0;
+            if (buffered == TOKEN_BUFFER_SIZE) {
+                if (wide_stats_update(&stats, tokens, buffered) < 0) goto memory;
+                buffered = 0;
+            }
+        }
+    }
+    if (ferror(stream.input)) {
+        perror(path);
+        goto done;
+    }
+    if (!width && filled) tokens[buffered++] = token;
+    // The last word doesn't need white space after it
+    if (width && filled) fprintf(stderr, "%s: ignoring the last %d bytes, not a whole token\n", path, filled);
+    if (wide_stats_update(&stats, tokens, buffered) < 0 || wide_stats_finish(&stats) < 0) goto memory;
+    codes = (HuffmanCode*)malloc((stats.count + 1) * sizeof(HuffmanCode));
+    if (!codes) goto memory;
+    if (build_wide_codes(&stats, codes) < 0) {
+        fprintf(stderr, "%s: the codes of %zu tokens don't fit in %d bits\n", path, stats.count, WIDE_MAX_CODE_LENGTH);
+        goto done;
+    }
+
+    uint64_t bits = wide_coded_bits(&stats, codes);
+    int longest = 0;
+    for (size_t i = 0; i < stats.count; ++i) {
+        if (codes[i].length > longest) longest = codes[i].length;
+    }
+    printf("Input Tokens:               %llu\n", (unsigned long long)stats.length);
+    printf("Distinct Tokens:            %zu\n", stats.count);
+    printf("Information Entropy:        %.4f bits per token\n", wide_entropy(&stats));
+    printf("Huffman Average Length:     %.4f bits per token\n", stats.length ? (double)bits / stats.length : 0.0);
+    printf("Huffman Coded Size:         %llu bytes\n", (unsigned long long)(bits + 7) / 8);
+    printf("Longest Code:               %d bits\n", longest);
+    status = 0;
+    goto done;
+
+memory:
+    perror("malloc");
+done:
+    free(codes);
+    wide_stats_free(&stats);
+    stream_close(&stream);
+    return status;
+}
+
+/**
+ * The compressed file is a sequence of independent blocks, each one has the
+ * code lengths of its own data, so the codes follow the statistics when they
+ * drift, and every block can be decoded alone:
+ *
+ *   file header   magic "HUFF" | version | flags | 2 reserved | block size (u32)
+ *                 | dictionary id (u32, only with CONTAINER_DICTIONARY)
+ *   block         mode | flags | table slot | reserved | raw length (u32)
+ *                 | payload length (u32) | Adler-32 of the raw data (u32) | payload
+ *   ...
+ *   end           a block header with mode BLOCK_END and everything else 0
+ *   block index   offset of the block (u64) | raw length (u32), per block
+ *   trailer       offset of the index (u64) | number of blocks (u32) | "HIDX"
+ *
+ * All integers are little endian, a block is coded by the library (see
+ * util/entropy.h) and this file only adds the container around the blocks. A
+ * reader can go through the blocks one by one from the start (the payload
+ * length says where the next block begins), or read the trailer and the
+ * index at the end and jump straight to any block.
+ *
+ * Except with --reuse-tables: then a block may take its table from an
+ * earlier one, the file header has CONTAINER_LINKED and the blocks can only
+ * be decoded in order, by one decoder. And with --dictionary the order doesn't
+ * matter, but decoding needs the same dictionary file.
+ */
+typedef struct {
+    uint64_t offset;
+    uint32_t raw_length;
+} BlockIndexEntry;
+
+void encode_block_task(void* context, void* slot, int thread) {
+    EntropyEncoder** encoders = (EntropyEncoder**)context;
+    ChunkJob* job = (ChunkJob*)slot;
+    size_t capacity = entropy_block_bound(job->length);
+    if (entropy_encode_block(encoders[thread], job->data, job->length, job->output, capacity, &job->output_length) != ENTROPY_OK) {
+        job->output_length = 0;
+    }
+}
+
+/**
+ * compress_file function writes the block container described above. Every
+ * block only depends on its own data, so it's a single pass over the input,
+ * and with `-j N` the blocks are encoded by N threads of a Scheduler. The
+ * finished blocks are written as soon as every block before them is.
+ */
+int compress_file(const char* path, const CodecOptions* codec_options) {
+    CodecOptions linked = *codec_options;
+    if (linked.reuse_tables) linked.jobs = 1;
+    // Every block may refer to the tables of the blocks before it
+    const CodecOptions* options = &linked;
+    const char* output_path = options->output_path;
+    CodecOptions windowed = linked;
+    windowed.jobs = options->jobs == 1 ? 1 : options->jobs * SCHEDULER_WINDOW;
+    // One ChunkJob of the stream per slot of the scheduler
+    int slots_count = windowed.jobs;
+    StreamInput stream;
+    Scheduler scheduler;
+    scheduler.finished = NULL;
+    EntropyEncoder* encoders[MAX_JOBS] = { NULL };
+    FILE* output = NULL;
+    BlockIndexEntry* index = NULL;
+    size_t index_size = 0, index_capacity = 0;
+    int status = 1;
+
+    if (stream_open(&stream, path, &windowed, options->block_size, 0) < 0) goto done;
+    if (stream_alloc_outputs(&stream, entropy_block_bound(options->block_size)) < 0) goto done;
+    EntropyEncoderOptions encoder_options = { options->builder, options->max_bits, options->streams, options->engine,
+                                              options->reuse_tables };
+    for (int j = 0; j < options->jobs; ++j) {
+        encoders[j] = entropy_encoder_create(&encoder_options);
+        if (!encoders[j]) {
+            perror("malloc");
+            goto done;
+        }
+        if (options->dictionary &&
+            entropy_encoder_load_dictionary(encoders[j], options->dictionary, options->dictionary_size)) {
+            fprintf(stderr, "%s: not a dictionary of version %d\n", options->dictionary_path, DICTIONARY_VERSION);
+            goto done;
+        }
+    }
+    if (scheduler_start(&scheduler, options->jobs, encode_block_task, encoders, stream.jobs, sizeof(ChunkJob),
+                        slots_count) < 0) {
+        perror("malloc");
+        goto done;
+    }
+
+    output = output_path ? fopen(output_path, "wb") : stdout;
+    if (!output) {
+        perror(output_path);
+        goto done;
+    }
+
+    unsigned char header[FILE_HEADER_SIZE];
+    memcpy(header, CONTAINER_MAGIC, 4);
+    header[4] = CONTAINER_VERSION;
+    header[5] = (options->reuse_tables ? CONTAINER_LINKED : 0) | (options->dictionary ? CONTAINER_DICTIONARY : 0);
+    header[6] = header[7] = 0;
+    store_le32(header + 8, (uint32_t)options->block_size);
+    fwrite(header, 1, sizeof(header), output);
+    uint64_t offset = FILE_HEADER_SIZE;
+    if (options->dictionary) {
+        unsigned char id[4];
+        store_le32(id, entropy_dictionary_id(options->dictionary));
+        fwrite(id, 1, sizeof(id), output);
+        offset += sizeof(id);
+    }
+
+    size_t submitted = 0;
+    int input_end = 0;
+    while (!input_end || index_size < submitted) {
+        while (!input_end && submitted - index_size < (size_t)slots_count) {
+            int slot = (int)(submitted % slots_count);
+            unsigned char* buffer = stream.batch ? stream.batch + (size_t)slot * options->block_size : NULL;
+            if (!stream_next_block(&stream, &stream.jobs[slot], buffer)) {
+                input_end = 1;
+                break;
+            }
+            scheduler_submit(&scheduler, slot);
+            submitted++;
+        }
+        if (index_size == submitted) break;
+
+        struct iovec vectors[MAX_JOBS * SCHEDULER_WINDOW];
+        int used = 0;
+        while (index_size < submitted &&
+               scheduler_collect(&scheduler, (int)(index_size % slots_count), used == 0)) {
+            // Waits for the next block, then takes the ones after it that are done too
+            ChunkJob* job = &stream.jobs[index_size % slots_count];
+            if (job->output_length == 0) {
+                fprintf(stderr, "%s: the symbols of block %zu don't fit in codes of %d bits\n", path, index_size,
+                        options->max_bits);
+                goto done;
+            }
+            if (index_size == index_capacity) {
+                index_capacity = index_capacity ? 2 * index_capacity : 1024;
+                BlockIndexEntry* grown = (BlockIndexEntry*)realloc(index, index_capacity * sizeof(BlockIndexEntry));
+                if (!grown) {
+                    perror("realloc");
+                    goto done;
+                }
+                index = grown;
+            }
+            index[index_size].offset = offset;
+            index[index_size++].raw_length = (uint32_t)job->length;
+            vectors[used].iov_base = job->output;
+            vectors[used++].iov_len = job->output_length;
+            offset += job->output_length;
+        }
+        STATS_BEGIN(start);
+        ssize_t written = write_vectors(output, vectors, used);
+        if (written < 0) {
+            perror(output_path ? output_path : "stdout");
+            goto done;
+        }
+        STATS_END(start, STATS_OUTPUT, written);
+    }
+    if (ferror(stream.input)) {
+        perror(path);
+        goto done;
+    }
+
+    unsigned char end[BLOCK_HEADER_SIZE] = { BLOCK_END };
+    fwrite(end, 1, sizeof(end), output);
+    uint64_t index_offset = offset + BLOCK_HEADER_SIZE;
+    for (size_t i = 0; i < index_size; ++i) {
+        unsigned char entry[INDEX_ENTRY_SIZE];
+        store_le64(entry, index[i].offset);
+        store_le32(entry + 8, index[i].raw_length);
+        fwrite(entry, 1, sizeof(entry), output);
+    }
+    unsigned char trailer[TRAILER_SIZE];
+    store_le64(trailer, index_offset);
+    store_le32(trailer + 8, (uint32_t)index_size);
+    memcpy(trailer + 12, INDEX_MAGIC, 4);
+    fwrite(trailer, 1, sizeof(trailer), output);
+
+    if (fflush(output) != 0 || ferror(output)) {
+        perror(output_path ? output_path : "stdout");
+        goto done;
+    }
+    status = 0;
+
+done:
+    scheduler_stop(&scheduler);
+    for (int j = 0; j < options->jobs; ++j) {
+        entropy_encoder_destroy(encoders[j]);
+    }
+    if (output && output != stdout) fclose(output);
+    free(index);
+    stream_close(&stream);
+    return status;
+}
+
+/**
+ * read_file_header function checks the file header and returns the block size
+ * of the file, its flags and the id of its dictionary (0 without one), or 0
+ * if it's not a compressed file.
+ */
+size_t read_file_header(FILE* input, const char* path, int* flags, uint32_t* dictionary_id) {
+    unsigned char header[FILE_HEADER_SIZE];
+    if (fread(header, 1, sizeof(header), input) != sizeof(header) ||
+        memcmp(header, CONTAINER_MAGIC, 4) != 0 || header[4] != CONTAINER_VERSION) {
+        fprintf(stderr, "%s: not a compressed file of version %d\n", path, CONTAINER_VERSION);
+        return 0;
+    }
+    if (header[5] & ~(CONTAINER_LINKED | CONTAINER_DICTIONARY)) {
+        fprintf(stderr, "%s: unknown file flags 0x%02x\n", path, header[5]);
+        return 0;
+    }
+    *flags = header[5];
+    *dictionary_id = 0;
+    unsigned char id[4];
+    if (*flags & CONTAINER_DICTIONARY) {
+        if (fread(id, 1, sizeof(id), input) != sizeof(id)) {
+            fprintf(stderr, "%s: not a compressed file of version %d\n", path, CONTAINER_VERSION);
+            return 0;
+        }
+        *dictionary_id = load_le32(id);
+    }
+    size_t block_size = load_le32(header + 8);
+    if (block_size == 0 || block_size > MAX_BLOCK_SIZE) {
+        fprintf(stderr, "%s: invalid block size %zu\n", path, block_size);
+        return 0;
+    }
+    return block_size;
+}
+
+/**
+ * read_block_header function reads the next block header to bytes, it returns
+ * 1 for a block, 0 for the end of blocks and -1 if the header is invalid.
+ */
+int read_block_header(FILE* input, size_t block_size, unsigned char bytes[], BlockHeader* header) {
+    if (fread(bytes, 1, BLOCK_HEADER_SIZE, input) != BLOCK_HEADER_SIZE) return -1;
+    block_header_read(bytes, header);
+    if (header->mode == BLOCK_END) return 0;
+    if (header->raw_length == 0 || header->raw_length > block_size ||
+        header->payload_length > entropy_block_bound(header->raw_length)) return -1;
+    return 1;
+}
+
+/**
+ * DecodeJob is one block for a slot of the decoder's Scheduler, every job
+ * keeps its own buffers between blocks, every thread its own decoder. block
+ * holds the header and the payload, as entropy_decode_block wants them.
  */
-double information_entropy(const char* str) {
-    int length = strlen(str);
-    if (length == 0) {
-        return 0.0;
+typedef struct {
+    BlockHeader header;
+    unsigned char* block;
+    size_t block_capacity;
+    unsigned char* output;
+    size_t output_capacity;
+    EntropyStatus status;
+} DecodeJob;
+
+void decode_block_task(void* context, void* slot, int thread) {
+    EntropyDecoder** decoders = (EntropyDecoder**)context;
+    DecodeJob* job = (DecodeJob*)slot;
+    size_t written;
+    job->status = entropy_decode_block(decoders[thread], job->block, BLOCK_HEADER_SIZE + job->header.payload_length,
+                                       job->output, job->output_capacity, &written);
+}
+
+/**
+ * read_block function reads the next block to job->block, which grows when
+ * needed. It returns like read_block_header.
+ */
+int read_block(FILE* input, size_t block_size, DecodeJob* job) {
+    unsigned char bytes[BLOCK_HEADER_SIZE];
+    int kind = read_block_header(input, block_size, bytes, &job->header);
+    if (kind <= 0) return kind;
+    size_t size = BLOCK_HEADER_SIZE + job->header.payload_length;
+    if (job->block_capacity < size) {
+        unsigned char* grown = (unsigned char*)realloc(job->block, size);
+        if (!grown) return -1;
+        job->block = grown;
+        job->block_capacity = size;
+    }
+    memcpy(job->block, bytes, BLOCK_HEADER_SIZE);
+    if (fread(job->block + BLOCK_HEADER_SIZE, 1, job->header.payload_length, input) != job->header.payload_length) {
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * read_block_index function reads the trailer and the index entry of block,
+ * it needs a seekable input. It returns the number of blocks or -1.
+ */
+long read_block_index(FILE* input, long block, BlockIndexEntry* entry) {
+    unsigned char trailer[TRAILER_SIZE];
+    if (fseeko(input, -TRAILER_SIZE, SEEK_END) != 0 || fread(trailer, 1, sizeof(trailer), input) != sizeof(trailer) ||
+        memcmp(trailer + 12, INDEX_MAGIC, 4) != 0) return -1;
+    uint64_t index_offset = load_le64(trailer);
+    long count = (long)load_le32(trailer + 8);
+    if (block < 0 || block >= count) return count;
+
+    unsigned char bytes[INDEX_ENTRY_SIZE];
+    if (fseeko(input, (off_t)(index_offset + (uint64_t)block * INDEX_ENTRY_SIZE), SEEK_SET) != 0 ||
+        fread(bytes, 1, sizeof(bytes), input) != sizeof(bytes)) return -1;
+    entry->offset = load_le64(bytes);
+    entry->raw_length = load_le32(bytes + 8);
+    return count;
+}
+
+/**
+ * decompress_file function reads the blocks one after another, with `-j N` it
+ * decodes them on the N threads of a Scheduler and writes them in order.
+ * With `--block K` it seeks to block K through the index and only decodes it.
+ */
+int decompress_file(const char* path, const CodecOptions* options) {
+    const char* output_path = options->output_path;
+    int threads_count = 0, slots_count = 0;
+    FILE* input = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    FILE* output = NULL;
+    DecodeJob* jobs = NULL;
+    EntropyDecoder* decoders[MAX_JOBS] = { NULL };
+    Scheduler scheduler;
+    scheduler.finished = NULL;
+    long block_number = 0;
+    int status = 1;
+
+    if (!input) {
+        perror(path);
+        goto done;
+    }
+    int flags;
+    uint32_t dictionary_id;
+    size_t block_size = read_file_header(input, path, &flags, &dictionary_id);
+    if (block_size == 0) goto done;
+    if ((flags & CONTAINER_DICTIONARY) &&
+        (!options->dictionary || entropy_dictionary_id(options->dictionary) != dictionary_id)) {
+        fprintf(stderr, "%s: needs the dictionary %08x (--dictionary)\n", path, dictionary_id);
+        goto done;
+    }
+    if ((flags & CONTAINER_LINKED) && options->block >= 0) {
+        fprintf(stderr, "%s: the blocks share tables (--reuse-tables), --block can't decode one alone\n", path);
+        goto done;
+    }
+    threads_count = options->block >= 0 || (flags & CONTAINER_LINKED) ? 1 : options->jobs;
+    // A linked file needs every block through the same decoder, in order
+    slots_count = threads_count == 1 ? 1 : threads_count * SCHEDULER_WINDOW;
+    jobs = (DecodeJob*)calloc(slots_count, sizeof(DecodeJob));
+    if (!jobs) {
+        perror("calloc");
+        goto done;
+    }
+    for (int j = 0; j < slots_count; ++j) {
+        jobs[j].output = (unsigned char*)malloc(block_size);
+        jobs[j].output_capacity = block_size;
+        if (!jobs[j].output) {
+            perror("malloc");
+            goto done;
+        }
+    }
+    for (int t = 0; t < threads_count; ++t) {
+        decoders[t] = entropy_decoder_create();
+        if (!decoders[t]) {
+            perror("malloc");
+            goto done;
+        }
+        if ((flags & CONTAINER_DICTIONARY) &&
+            entropy_decoder_load_dictionary(decoders[t], options->dictionary, options->dictionary_size)) {
+            fprintf(stderr, "%s: not a dictionary of version %d\n", options->dictionary_path, DICTIONARY_VERSION);
+            goto done;
+        }
     }
-    int appear_times[ASCII] = { 0 };
-    double appear_frequencies[ASCII] = { 0.0 };
-    double entropy = 0.0;
 
-    for (int i = 0; i < length; ++i) {
-        appear_times[(unsigned char)str[i]]++;
+    if (options->block >= 0) {
+        BlockIndexEntry entry;
+        long count = read_block_index(input, options->block, &entry);
+        if (count < 0) {
+            fprintf(stderr, "%s: can't read the block index (is it a regular file?)\n", path);
+            goto done;
+        }
+        if (options->block >= count) {
+            fprintf(stderr, "%s: there are only %ld blocks\n", path, count);
+            goto done;
+        }
+        if (fseeko(input, (off_t)entry.offset, SEEK_SET) != 0) goto corrupted;
+        block_number = options->block;
     }
 
-    for (int i = 0; i < ASCII; ++i) {
-        appear_frequencies[i] = (double)appear_times[i] / length;
-        if (appear_times[i] != 0) {
-            entropy -= appear_frequencies[i] * log2(appear_frequencies[i]);
+    output = output_path ? fopen(output_path, "wb") : stdout;
+    if (!output) {
+        perror(output_path);
+        goto done;
+    }
 
-            // At first I use ℍ(x) = ∑ [f(xᵢ) * log₂(1 / f(xᵢ))] but here the
-            // precision of floating number will be lost two times! One for
-            // reciprocal and one for logarithm.
+    if (scheduler_start(&scheduler, threads_count, decode_block_task, decoders, jobs, sizeof(DecodeJob),
+                        slots_count) < 0) {
+        perror("malloc");
+        goto done;
+    }
+
+    long submitted = block_number;
+    int end = 0, unreadable = 0;
+    while (!end || block_number < submitted) {
+        while (!end && submitted - block_number < slots_count) {
+            int kind = read_block(input, block_size, &jobs[submitted % slots_count]);
+            if (kind <= 0) {
+                unreadable = kind < 0;
+                end = 1;
+                break;
+            }
+            scheduler_submit(&scheduler, (int)(submitted++ % slots_count));
+            if (options->block >= 0) end = 1;
+        }
+        if (block_number == submitted) break;
+
+        struct iovec vectors[MAX_JOBS * SCHEDULER_WINDOW];
+        int decoded = 0, failed = 0;
+        while (block_number + decoded < submitted &&
+               scheduler_collect(&scheduler, (int)((block_number + decoded) % slots_count), decoded == 0)) {
+            DecodeJob* job = &jobs[(block_number + decoded) % slots_count];
+            if (job->status != ENTROPY_OK) {
+                failed = 1;
+                break;
+            }
+            vectors[decoded].iov_base = job->output;
+            vectors[decoded++].iov_len = job->header.raw_length;
+        }
+        STATS_BEGIN(start);
+        ssize_t written = write_vectors(output, vectors, decoded);
+        if (written < 0) {
+            perror(output_path ? output_path : "stdout");
+            goto done;
         }
+        STATS_END(start, STATS_OUTPUT, written);
+        block_number += decoded;
+        if (failed) goto corrupted;
+        // The blocks before the corrupted one are still written
     }
+    if (unreadable) goto corrupted;
+    if (fflush(output) != 0 || ferror(output)) {
+        perror(output_path ? output_path : "stdout");
+        goto done;
+    }
+    status = 0;
+    goto done;
 
-    return entropy;
+corrupted:
+    fprintf(stderr, "%s: block %ld is corrupted\n", path, block_number);
+done:
+    scheduler_stop(&scheduler);
+    if (output && output != stdout) fclose(output);
+    if (input && input != stdin) fclose(input);
+    for (int j = 0; jobs && j < slots_count; ++j) {
+        free(jobs[j].block);
+        free(jobs[j].output);
+    }
+    for (int t = 0; t < threads_count; ++t) {
+        entropy_decoder_destroy(decoders[t]);
+    }
+    free(jobs);
+    return status;
 }
 
-/* calculate the total information of a string.
+/**
+ * list_blocks function prints the block index of a compressed file.
  */
-double information_value(const char* str) {
-    int length = strlen(str);
-    if (length == 0) {
-        return 0.0;
+int list_blocks(const char* path) {
+    FILE* input = fopen(path, "rb");
+    if (!input) {
+        perror(path);
+        return 1;
+    }
+    int flags;
+    uint32_t dictionary_id;
+    size_t block_size = read_file_header(input, path, &flags, &dictionary_id);
+    BlockIndexEntry entry;
+    long count = block_size ? read_block_index(input, -1, &entry) : -1;
+    if (count < 0) {
+        if (block_size) fprintf(stderr, "%s: can't read the block index\n", path);
+        fclose(input);
+        return 1;
     }
-    int appear_times[ASCII] = { 0 };
-    double appear_frequencies[ASCII] = { 0.0 };
-    double information = 0.0;
 
-    for (int i = 0; i < length; ++i) {
-        appear_times[(unsigned char)str[i]]++;
+    printf("%8s %14s %10s %10s %6s %8s\n", "block", "offset", "raw", "payload", "mode", "table");
+    for (long i = 0; i < count; ++i) {
+        unsigned char bytes[BLOCK_HEADER_SIZE];
+        BlockHeader header;
+        if (read_block_index(input, i, &entry) < 0 || fseeko(input, (off_t)entry.offset, SEEK_SET) != 0 ||
+            read_block_header(input, block_size, bytes, &header) <= 0) {
+            fprintf(stderr, "%s: block %ld is corrupted\n", path, i);
+            fclose(input);
+            return 1;
+        }
+        char table[16] = "-";
+        if (header.flags == BLOCK_FLAG_DICTIONARY) {
+            snprintf(table, sizeof(table), "dict");
+        } else if (header.flags) {
+            snprintf(table, sizeof(table), "%s %d", header.flags & BLOCK_FLAG_REUSE ? "reuse" : "store", header.table);
+        }
+        printf("%8ld %14llu %10u %10u %6d %8s\n", i, (unsigned long long)entry.offset, entry.raw_length,
+               header.payload_length, header.mode, table);
     }
+    fclose(input);
+    return 0;
+}
 
-    for (int i = 0; i < ASCII; ++i) {
-        appear_frequencies[i] = (double)appear_times[i] / length;
-        if (appear_times[i] != 0) {
-            information -= appear_times[i] * log2(appear_frequencies[i]);
+/**
+ * train_dictionary function counts all the samples into one histogram, by the
+ * same counting passes as stream_huffman_result, and writes the dictionary
+ * of it to OUT (default stdout).
+ */
+int train_dictionary(int count, char* paths[], const CodecOptions* options) {
+    const char* output_path = options->output_path;
+    SymbolStats samples;
+    symbol_stats_init(&samples);
+    for (int i = 0; i < count; ++i) {
+        StreamInput stream = { 0 };
+        SymbolStats stats;
+        int status = stream_open(&stream, paths[i], options, STREAM_BLOCK_SIZE, 0) < 0 ? -1
+                     : stream_count(&stream, &stats);
+        stream_close(&stream);
+        if (status < 0) return 1;
+        for (int s = 0; s < ASCII; ++s) {
+            samples.appear_times[s] += stats.appear_times[s];
         }
+        samples.length += stats.length;
     }
+    symbol_stats_finish(&samples);
 
-    return information;
+    unsigned char dictionary[DICTIONARY_SIZE];
+    if (entropy_dictionary_train(&samples, dictionary) != ENTROPY_OK) {
+        fprintf(stderr, "%s: the samples are empty\n", paths[0]);
+        return 1;
+    }
+    FILE* output = output_path ? fopen(output_path, "wb") : stdout;
+    if (!output) {
+        perror(output_path);
+        return 1;
+    }
+    int status = 0;
+    if (fwrite(dictionary, 1, sizeof(dictionary), output) != sizeof(dictionary) || fflush(output) != 0) {
+        perror(output_path ? output_path : "stdout");
+        status = 1;
+    }
+    if (output != stdout) fclose(output);
+    fprintf(stderr, "dictionary %08x: %llu bytes of %d samples, %d symbols, %.4f bits\n",
+            entropy_dictionary_id(dictionary), (unsigned long long)samples.length, count, samples.count,
+            information_entropy(&samples));
+    return status;
 }
 
-int main() {
+/**
+ * map_dictionary function maps the dictionary file to options, the library
+ * reads the tables straight from the mapping.
+ */
+int map_dictionary(CodecOptions* options) {
+    FILE* file = fopen(options->dictionary_path, "rb");
+    struct stat info;
+    if (!file || fstat(fileno(file), &info) < 0) {
+        perror(options->dictionary_path);
+        if (file) fclose(file);
+        return -1;
+    }
+    void* map = info.st_size > 0 ? mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0)
+                                 : MAP_FAILED;
+    fclose(file);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "%s: not a dictionary of version %d\n", options->dictionary_path, DICTIONARY_VERSION);
+        return -1;
+    }
+    options->dictionary = (const unsigned char*)map;
+    options->dictionary_size = (size_t)info.st_size;
+    return 0;
+}
+
+/**
+ * interactive_result function reads one line from the terminal and prints
+ * everything about it, including the whole coding result.
+ */
+int interactive_result(void) {
     char input[3000];
     printf("Enter the input string: ");
-    fgets(input, sizeof(input), stdin);
+    if (!fgets(input, sizeof(input), stdin)) input[0] = '\0';
     input[strcspn(input, "\n")] = '\0';
     printf("\n");
 
+    SymbolStats stats;
+    symbol_stats_init(&stats);
+    symbol_stats_update(&stats, (unsigned char*)input, strlen(input));
+    symbol_stats_finish(&stats);
+    // Only one counting pass, every result below is computed from stats
+
     printf("Input String:               %s\n", input);
-    printf("Information Entropy:        %.4f bits\n", information_entropy(input));
-    printf("Information Value:          %.4f bits\n", information_value(input));
-    print_huffman_result(input);
+    printf("Information Entropy:        %.4f bits\n", information_entropy(&stats));
+    printf("Information Value:          %.4f bits\n", information_value(&stats));
+    print_huffman_result(&stats, (unsigned char*)input);
     return 0;
+}
+
+/**
+ * dump_stats function writes the -DENTROPY_STATS counters of the whole run as
+ * JSON, to stderr for "-" so they don't mix with a result on stdout.
+ */
+int dump_stats(const char* path) {
+#ifdef ENTROPY_STATS
+    FILE* out = strcmp(path, "-") == 0 ? stderr : fopen(path, "w");
+    if (!out) {
+        perror(path);
+        return -1;
+    }
+    entropy_stats_dump_json(out);
+    if (out != stderr) fclose(out);
+#else
+    (void)path;
+#endif
+    return 0;
+}
+
+void print_usage(const char* program) {
+    fprintf(stderr,
+            "Usage:\n"
+            "  %s                          read one line interactively\n"
+            "  %s [-j N] FILE              stream FILE of any size (binary data is also fine)\n"
+            "  %s [-j N] -                 stream stdin\n"
+            "  %s -c [-j N] [-o OUT] FILE  compress FILE to OUT (default stdout)\n"
+            "  %s -d [-j N] [-o OUT] FILE  decompress FILE to OUT (default stdout)\n"
+            "  %s --list FILE              print the block index of a compressed FILE\n"
+            "  %s --train [-o OUT] FILE... train a dictionary on the sample FILEs\n"
+            "  %s --context FILE           print the order-0, order-1 and order-2 entropy\n"
+            "  %s --window W FILE          print where the entropy of W bytes goes high\n"
+            "  %s --tokens T FILE          Huffman summary of 16-bit, 32-bit or word tokens\n"
+            "\n"
+            "  -j N            count and encode with N threads\n"
+            "  --max-bits N    limit the code length to N bits (package-merge)\n"
+            "  --builder B     build the code with `heap` (default) or `inplace`\n"
+            "  --block-size N  compress in blocks of N bytes (default 131072)\n"
+            "  --streams 4     code every block to 4 interleaved bitstreams\n"
+            "  --engine E      code the blocks with `auto` (default, raw, RLE, Huffman or\n"
+            "                  tANS per block), `huffman` or `tans`\n"
+            "  --reuse-tables  code blocks of the same statistics with a cached table,\n"
+            "                  the file is then compressed and decompressed on 1 thread\n"
+            "  --dictionary D  code small blocks with the tables of dictionary D (-c and -d)\n"
+            "  --block K       only decompress block K (needs a regular FILE)\n"
+            "  --no-mmap       read FILE with fread instead of mapping it\n"
+            "  --threshold T   entropy in bits above which --window reports (default 7)\n"
+            "  --tokens T      `16` or `32` for little endian integers, `words` for words\n"
+            "  --stats[=OUT]   write the phase counters as JSON to OUT (default stderr),\n"
+            "                  needs a build with -DENTROPY_STATS\n",
+            program, program, program, program, program, program, program, program, program, program);
+}
+
+int main(int argc, char* argv[]) {
+    static const struct option long_options[] = {
+        { "jobs", required_argument, NULL, 'j' },
+        { "compress", no_argument, NULL, 'c' },
+        { "decompress", no_argument, NULL, 'd' },
+        { "output", required_argument, NULL, 'o' },
+        { "max-bits", required_argument, NULL, 'm' },
+        { "builder", required_argument, NULL, 'b' },
+        { "block-size", required_argument, NULL, 'S' },
+        { "block", required_argument, NULL, 'K' },
+        { "list", no_argument, NULL, 'L' },
+        { "no-mmap", no_argument, NULL, 'N' },
+        { "context", no_argument, NULL, 'C' },
+        { "window", required_argument, NULL, 'W' },
+        { "tokens", required_argument, NULL, 'k' },
+        { "threshold", required_argument, NULL, 'H' },
+        { "streams", required_argument, NULL, 's' },
+        { "engine", required_argument, NULL, 'E' },
+        { "reuse-tables", no_argument, NULL, 'R' },
+        { "train", no_argument, NULL, 'A' },
+        { "dictionary", required_argument, NULL, 'D' },
+        { "stats", optional_argument, NULL, 'T' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    CodecOptions options = { .jobs = 1, .builder = BUILDER_HEAP, .block_size = DEFAULT_BLOCK_SIZE,
+                             .streams = 1, .engine = ENGINE_AUTO, .use_mmap = 1, .threshold = 7.0, .block = -1 };
+    int compress = 0;
+    int decompress = 0;
+    int list = 0;
+    int context = 0;
+    int train = 0;
+    const char* stats_path = NULL;
+    int option;
+
+    while ((option = getopt_long(argc, argv, "j:cdo:h", long_options, NULL)) != -1) {
+        switch (option) {
+        case 'c':
+            compress = 1;
+            break;
+        case 'd':
+            decompress = 1;
+            break;
+        case 'o':
+            options.output_path = optarg;
+            break;
+        case 'j':
+            options.jobs = atoi(optarg);
+            if (options.jobs < 1 || options.jobs > MAX_JOBS) {
+                fprintf(stderr, "%s: -j must be between 1 and %d\n", argv[0], MAX_JOBS);
+                return 1;
+            }
+            break;
+        case 'm':
+            options.max_bits = atoi(optarg);
+            if (options.max_bits < 1 || options.max_bits > MAX_CODE_LENGTH) {
+                fprintf(stderr, "%s: --max-bits must be between 1 and %d\n", argv[0], MAX_CODE_LENGTH);
+                return 1;
+            }
+            break;
+        case 'b':
+            if (strcmp(optarg, "heap") == 0) {
+                options.builder = BUILDER_HEAP;
+            } else if (strcmp(optarg, "inplace") == 0) {
+                options.builder = BUILDER_INPLACE;
+            } else {
+                fprintf(stderr, "%s: unknown builder %s\n", argv[0], optarg);
+                return 1;
+            }
+            break;
+        case 'S':
+            options.block_size = (size_t)atol(optarg);
+            if (options.block_size < 1 || options.block_size > MAX_BLOCK_SIZE) {
+                fprintf(stderr, "%s: --block-size must be between 1 and %d\n", argv[0], MAX_BLOCK_SIZE);
+                return 1;
+            }
+            break;
+        case 'K':
+            options.block = atol(optarg);
+            if (options.block < 0) {
+                fprintf(stderr, "%s: --block must be at least 0\n", argv[0]);
+                return 1;
+            }
+            break;
+        case 'L':
+            list = 1;
+            break;
+        case 'N':
+            options.use_mmap = 0;
+            break;
+        case 'C':
+            context = 1;
+            break;
+        case 'W':
+            options.window = (size_t)atol(optarg);
+            if (options.window < 1 || options.window > MAX_ROLLING_WINDOW) {
+                fprintf(stderr, "%s: --window must be between 1 and %d\n", argv[0], MAX_ROLLING_WINDOW);
+                return 1;
+            }
+            break;
+        case 'H':
+            options.threshold = atof(optarg);
+            break;
+        case 'k':
+            if (strcmp(optarg, "16") == 0 || strcmp(optarg, "32") == 0) {
+                options.tokens = atoi(optarg);
+            } else if (strcmp(optarg, "words") == 0) {
+                options.tokens = TOKEN_WORDS;
+            } else {
+                fprintf(stderr, "%s: --tokens must be 16, 32 or words\n", argv[0]);
+                return 1;
+            }
+            break;
+        case 's':
+            options.streams = atoi(optarg);
+            if (options.streams != 1 && options.streams != HUFFMAN_STREAMS) {
+                fprintf(stderr, "%s: --streams must be 1 or %d\n", argv[0], HUFFMAN_STREAMS);
+                return 1;
+            }
+            break;
+        case 'E':
+            if (strcmp(optarg, "huffman") == 0) {
+                options.engine = ENGINE_HUFFMAN;
+            } else if (strcmp(optarg, "tans") == 0) {
+                options.engine = ENGINE_TANS;
+            } else if (strcmp(optarg, "auto") == 0) {
+                options.engine = ENGINE_AUTO;
+            } else {
+                fprintf(stderr, "%s: unknown engine %s\n", argv[0], optarg);
+                return 1;
+            }
+            break;
+        case 'R':
+            options.reuse_tables = 1;
+            break;
+        case 'A':
+            train = 1;
+            break;
+        case 'D':
+            options.dictionary_path = optarg;
+            break;
+        case 'T':
+#ifdef ENTROPY_STATS
+            stats_path = optarg ? optarg : "-";
+#else
+            fprintf(stderr, "%s: --stats needs a build with -DENTROPY_STATS\n", argv[0]);
+            return 1;
+#endif
+            break;
+        case 'h':
+            print_usage(argv[0]);
+            return 0;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if ((list || train) && optind >= argc) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (options.dictionary_path && map_dictionary(&options) < 0) return 1;
+
+    int status;
+    if (compress) {
+        status = compress_file(optind < argc ? argv[optind] : "-", &options);
+    } else if (decompress) {
+        status = decompress_file(optind < argc ? argv[optind] : "-", &options);
+    } else if (list) {
+        status = list_blocks(argv[optind]);
+    } else if (train) {
+        status = train_dictionary(argc - optind, argv + optind, &options);
+    } else if (options.tokens) {
+        status = token_entropy_result(optind < argc ? argv[optind] : "-", &options);
+    } else if (options.window) {
+        status = rolling_entropy_result(optind < argc ? argv[optind] : "-", &options);
+    } else if (context) {
+        status = context_entropy_result(optind < argc ? argv[optind] : "-", &options);
+    } else if (optind < argc) {
+        status = stream_huffman_result(argv[optind], &options);
+    } else {
+        status = interactive_result();
+    }
+    if (stats_path && dump_stats(stats_path) < 0) status = 1;
+    if (options.dictionary) munmap((void*)options.dictionary, options.dictionary_size);
+    return status;
 }
\ No newline at end of file
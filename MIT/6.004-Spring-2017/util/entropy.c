@@ -0,0 +1,3596 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "entropy.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HISTOGRAM_AVX2 1
+#define KERNELS_BMI2 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define HISTOGRAM_NEON 1
+#endif
+
+#define JUMP_TABLE_SIZE (4 * (HUFFMAN_STREAMS - 1))
+// A BLOCK_HUFFMAN4 block keeps the sizes of its first 3 bitstreams
+
+#define FAST_LOG2_BITS 10
+#define CLOG2_TABLE_SIZE 4096
+// information_entropy_fast interpolates log2 between 2^10 points of [1, 2)
+// and looks c·log2(c) up directly for counts below 4096.
+
+#define ADLER_MOD 65521
+#define ADLER_NMAX 5552
+#define DECODE_TABLE_BITS 12
+#define TANS_TABLE_LOG 11
+#define TANS_MIN_TABLE_LOG 5
+// A tANS table has 2^table_log states, table_log is stored in each block
+#define TANS_HEADER_SIZE (1 + ASCII / 8 + 2 * ASCII)
+#define AUTO_RAW_ENTROPY 7.9
+#define AUTO_RLE_DOMINANT 0.875
+#define AUTO_HUFFMAN_SLACK 0.02
+#define TABLE_CACHE_SLOTS 4
+#define SIGNATURE_RARE (1 << 11)
+// The thresholds of ENGINE_AUTO, see auto_block_mode
+// 2¹² entries of 2 bytes, 8 KiB, small enough to stay in L1 cache. With
+// `--max-bits 12` or less every code is decoded with exactly one lookup.
+
+/**
+ * HuffmanTree is a whole tree in one array, 6 bytes a node, where a node
+ * names its children by their index. nodes[0] is the root and the nodes are
+ * in BFS order: every level comes right after the one above it, so a walk
+ * from the root only goes forward and the top levels (the ones every walk
+ * crosses) share a few cache lines.
+ *
+ *         0            nodes: [ 0: 1 2 | 1: a | 2: 3 4 | 3: b | 4: c ]
+ *        / \
+ *       a   2          child 0 means none (the root is nobody's child),
+ *          / \         symbol is -1 for an inner node
+ *         b   c
+ *
+ * While a tree is built its nodes are in the order they're made, from
+ * nodes[1] on, and huffman_tree_flatten puts them in BFS order at the end. So
+ * no node is ever malloc'd or freed and nothing leaks between builds.
+ */
+typedef struct {
+    uint16_t child[2];
+    int16_t symbol;
+} HuffmanNode;
+
+#define MAX_HUFFMAN_NODES (2 * ASCII - 1)
+// A Huffman tree with n leaves has exactly n - 1 inner nodes.
+
+typedef struct {
+    HuffmanNode nodes[MAX_HUFFMAN_NODES + 1];
+    int used;
+} HuffmanTree;
+
+typedef struct {
+    int size;
+    uint16_t data[ASCII];
+    // data[i] is the index of a node of the tree being built, a heap never
+    // holds more than ASCII nodes because every extract-extract-insert round
+    // shrinks it. data[0] is the root of this min heap (or priority queue)
+    const uint64_t* counts;
+    // counts[node] is how often the symbols under node appear
+#ifdef ENTROPY_STATS
+    uint64_t inserts, extracts, swaps;
+    // Counted here and added to the global counters once per tree
+#endif
+} MinHeap;
+
+#ifdef ENTROPY_STATS
+#define STATS_ONLY(statement) statement
+#else
+#define STATS_ONLY(statement)
+#endif
+
+static void heap_init(MinHeap* heap, const uint64_t* counts) {
+    heap->size = 0;
+    heap->counts = counts;
+    STATS_ONLY(heap->inserts = heap->extracts = heap->swaps = 0);
+    // data is a fixed array inside of MinHeap, so a heap on the stack needs
+    // no malloc (and no free)
+}
+
+/**
+ * swap function is used to swap two huffman nodes in heapify function
+ */
+static void swap(uint16_t* a, uint16_t* b) {
+    uint16_t temp = *a;
+    *a = *b;
+    *b = temp;
+}
+
+/**
+ * heapify function operates from position i to bottom unless the parent node has
+ * been less than its two children nodes.
+ *
+ *             [i]
+ *            /   \
+ *      [2i+1]     [2i+2]
+ *
+ * smallest ← index of min([i].c, [2i+1].c, [2i+2].c)
+ * swap smallest and i, it only ensure every parent node is less than its children 
+ * nodes
+ */
+static void heapify(MinHeap* heap, int i) {
+    int smallest = i;
+    int l = 2 * i + 1;
+    int r = 2 * i + 2;
+    if (l < heap->size && heap->counts[heap->data[l]] < heap->counts[heap->data[smallest]])
+        smallest = l;
+    if (r < heap->size && heap->counts[heap->data[r]] < heap->counts[heap->data[smallest]])
+        smallest = r;
+    // First check which one is the smallest
+    if (smallest != i) {
+        swap(&heap->data[i], &heap->data[smallest]);
+        STATS_ONLY(heap->swaps++);
+        heapify(heap, smallest);
+    }
+}
+
+/**
+ * heap_insert functions is also a kind of heapify but it's from bottom up!
+ */
+static void heap_insert(MinHeap* heap, uint16_t node) {
+    int i = heap->size++;
+    heap->data[i] = node;
+    STATS_ONLY(heap->inserts++);
+
+    while (i && heap->counts[heap->data[(i - 1) / 2]] > heap->counts[heap->data[i]]) {
+        // No matter i is left leaf or right leaf, [(i - 1) / 2] is always [i]'s
+        // parent node.
+        swap(&heap->data[i], &heap->data[(i - 1) / 2]);
+        STATS_ONLY(heap->swaps++);
+        i = (i - 1) / 2;
+    }
+}
+
+/**
+ * heap_extract_min function pops the root of min heap, and change heap size,
+ * change pointing position of heap[0] to the last element and heapify.
+ */
+static uint16_t heap_extract_min(MinHeap* heap) {
+    uint16_t root = heap->data[0];
+    heap->data[0] = heap->data[--heap->size];
+    STATS_ONLY(heap->extracts++);
+    heapify(heap, 0);
+    return root;
+}
+
+static void huffman_tree_reset(HuffmanTree* tree) {
+    tree->used = 1;
+    // nodes[0] is where the root goes, see huffman_tree_flatten
+}
+
+/**
+ * huffman_tree_node function takes the next node of tree, it returns 0 when
+ * all MAX_HUFFMAN_NODES nodes are used.
+ */
+static uint16_t huffman_tree_node(HuffmanTree* tree, int symbol) {
+    if (tree->used == MAX_HUFFMAN_NODES + 1) return 0;
+    HuffmanNode* node = &tree->nodes[tree->used];
+    node->child[0] = node->child[1] = 0;
+    node->symbol = (int16_t)symbol;
+    return (uint16_t)tree->used++;
+}
+
+/**
+ * huffman_tree_flatten function puts the nodes under root in BFS order, the
+ * nodes no one reaches from root are dropped.
+ */
+static void huffman_tree_flatten(HuffmanTree* tree, uint16_t root) {
+    HuffmanNode built[MAX_HUFFMAN_NODES + 1];
+    memcpy(built + 1, tree->nodes + 1, (tree->used - 1) * sizeof(HuffmanNode));
+    uint16_t queue[MAX_HUFFMAN_NODES + 1];
+    int head = 0, tail = 1;
+    queue[0] = root;
+    while (head < tail) {
+        HuffmanNode node = built[queue[head]];
+        for (int b = 0; b < 2; ++b) {
+            if (!node.child[b]) continue;
+            queue[tail] = node.child[b];
+            node.child[b] = (uint16_t)tail++;
+        }
+        tree->nodes[head++] = node;
+    }
+    tree->used = tail;
+}
+
+/**
+ * Every node of min heap is a sub-binary-tree of the nodes of tree. When
+ * inserting back the reduction node (which is `w` in the following code),
+ * it also compares with remaining nodes.
+ *
+ * => [A, B, C, D]
+ * => [A, B, (C,D)]
+ * => [B, ((C,D),A)]
+ * => [(((C,D),A),B)]
+ *
+ * so when the size of heap comes to 1, there is only a Huffman tree in this
+ * heap! The weights are the counts themselves, integers add up exactly where
+ * sums of double frequencies would round.
+ */
+static void build_huffman(HuffmanTree* tree, const unsigned char* symbols, const uint64_t appear_times[], int n) {
+    uint64_t counts[MAX_HUFFMAN_NODES + 1];
+    MinHeap heap;
+    heap_init(&heap, counts);
+    huffman_tree_reset(tree);
+
+    for (int i = 0; i < n; ++i) {
+        uint16_t leaf = huffman_tree_node(tree, symbols[i]);
+        counts[leaf] = appear_times[symbols[i]];
+        heap_insert(&heap, leaf);
+    }
+
+    while (heap.size > 1) {
+        uint16_t u = heap_extract_min(&heap);
+        uint16_t v = heap_extract_min(&heap);
+
+        uint16_t w = huffman_tree_node(tree, -1);
+        tree->nodes[w].child[0] = u;
+        tree->nodes[w].child[1] = v;
+        counts[w] = counts[u] + counts[v];
+
+        heap_insert(&heap, w);
+    }
+
+    uint16_t root = heap_extract_min(&heap);
+    STATS_ONLY(entropy_stats_heap(heap.inserts, heap.extracts, heap.swaps));
+    huffman_tree_flatten(tree, root);
+}
+
+/**
+ * huffman_code function will store the map between symbols and coding result.
+ * The path from root is an integer: going left appends a 0 bit and going right
+ * appends a 1 bit. In BFS order a parent comes before its children, so a
+ * single pass from the root hands every node its path and depth, no
+ * recursion. It returns -1 if any code is longer than MAX_CODE_LENGTH.
+ */
+static int huffman_code(const HuffmanTree* tree, HuffmanCode table[]) {
+    uint64_t paths[MAX_HUFFMAN_NODES + 1];
+    unsigned char depths[MAX_HUFFMAN_NODES + 1];
+    paths[0] = 0;
+    depths[0] = 0;
+    for (int i = 0; i < tree->used; ++i) {
+        const HuffmanNode* node = &tree->nodes[i];
+        if (node->symbol >= 0) {
+            table[node->symbol].bits = paths[i];
+            table[node->symbol].length = depths[i];
+            // path is passed by value, so unlike a shared char buffer it doesn't
+            // need to be copied with strdup for every symbol.
+            continue;
+        }
+        if (depths[i] == MAX_CODE_LENGTH) return -1;
+        for (int b = 0; b < 2; ++b) {
+            paths[node->child[b]] = (paths[i] << 1) | b;
+            depths[node->child[b]] = depths[i] + 1;
+        }
+    }
+    return 0;
+}
+
+void symbol_stats_init(SymbolStats* stats) {
+    memset(stats, 0, sizeof(SymbolStats));
+}
+
+#define HISTOGRAM_TABLES 4
+#define HISTOGRAM_CHUNK (1u << 30)
+// Every sub-table counts at most HISTOGRAM_CHUNK bytes before it's merged, so
+// the 32 bits counters never overflow.
+
+/**
+ * histogram_naive function is the textbook counting loop. When the same byte
+ * repeats, every `++` has to wait for the previous store to the same counter
+ * (store-to-load forwarding), so skewed text is the slowest case for it.
+ */
+void histogram_naive(const unsigned char* data, size_t length, uint64_t appear_times[]) {
+    for (size_t i = 0; i < length; ++i) {
+        appear_times[data[i]]++;
+    }
+}
+
+/**
+ * histogram_merge function adds the sub-tables to appear_times and clears them.
+ */
+static void histogram_merge(uint32_t tables[HISTOGRAM_TABLES][ASCII], uint64_t appear_times[]) {
+    for (int i = 0; i < ASCII; ++i) {
+        uint64_t sum = 0;
+        for (int t = 0; t < HISTOGRAM_TABLES; ++t) {
+            sum += tables[t][i];
+            tables[t][i] = 0;
+        }
+        appear_times[i] += sum;
+    }
+}
+
+/**
+ * histogram_count_16 function counts 16 bytes, the k-th byte of every group of
+ * four goes to tables[k], so four equal bytes in a row update four different
+ * counters and don't wait for each other.
+ */
+static inline void histogram_count_16(const unsigned char* p, uint32_t tables[HISTOGRAM_TABLES][ASCII]) {
+    uint64_t a, b;
+    memcpy(&a, p, 8);
+    memcpy(&b, p + 8, 8);
+    // memcpy is compiled to one unaligned load, the byte order doesn't matter
+    // for counting.
+    for (int k = 0; k < 8; k += 4) {
+        tables[0][(uint8_t)(a >> (8 * k))]++;
+        tables[1][(uint8_t)(a >> (8 * k + 8))]++;
+        tables[2][(uint8_t)(a >> (8 * k + 16))]++;
+        tables[3][(uint8_t)(a >> (8 * k + 24))]++;
+        tables[0][(uint8_t)(b >> (8 * k))]++;
+        tables[1][(uint8_t)(b >> (8 * k + 8))]++;
+        tables[2][(uint8_t)(b >> (8 * k + 16))]++;
+        tables[3][(uint8_t)(b >> (8 * k + 24))]++;
+    }
+}
+
+/**
+ * histogram_scalar function is the portable kernel, it uses HISTOGRAM_TABLES
+ * interleaved sub-tables which are merged at the end.
+ */
+void histogram_scalar(const unsigned char* data, size_t length, uint64_t appear_times[]) {
+    uint32_t tables[HISTOGRAM_TABLES][ASCII] = { { 0 } };
+
+    while (length > 0) {
+        size_t chunk = length < HISTOGRAM_CHUNK ? length : HISTOGRAM_CHUNK;
+        size_t i = 0;
+        for (; i + 16 <= chunk; i += 16) {
+            histogram_count_16(data + i, tables);
+        }
+        for (; i < chunk; ++i) {
+            tables[i % HISTOGRAM_TABLES][data[i]]++;
+        }
+        histogram_merge(tables, appear_times);
+        data += chunk;
+        length -= chunk;
+    }
+}
+
+/**
+ * A byte histogram can't really be vectorized: there is no SIMD instruction
+ * to increment 32 different counters at once. What SIMD does well here is the
+ * common skewed case: when 32 (or 16 for NEON) bytes in a row are all the same
+ * symbol, one compare tells us so and the counter gets +32 in one step.
+ * Otherwise these bytes are counted by the scalar kernel.
+ */
+#if defined(HISTOGRAM_AVX2)
+__attribute__((target("avx2")))
+static void histogram_avx2(const unsigned char* data, size_t length, uint64_t appear_times[]) {
+    uint32_t tables[HISTOGRAM_TABLES][ASCII] = { { 0 } };
+
+    while (length > 0) {
+        size_t chunk = length < HISTOGRAM_CHUNK ? length : HISTOGRAM_CHUNK;
+        size_t i = 0;
+        for (; i + 32 <= chunk; i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(data + i));
+            __m256i first = _mm256_set1_epi8((char)data[i]);
+            if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, first)) == -1) {
+                tables[0][data[i]] += 32;
+            } else {
+                histogram_count_16(data + i, tables);
+                histogram_count_16(data + i + 16, tables);
+            }
+        }
+        for (; i < chunk; ++i) {
+            tables[i % HISTOGRAM_TABLES][data[i]]++;
+        }
+        histogram_merge(tables, appear_times);
+        data += chunk;
+        length -= chunk;
+    }
+}
+#elif defined(HISTOGRAM_NEON)
+static void histogram_neon(const unsigned char* data, size_t length, uint64_t appear_times[]) {
+    uint32_t tables[HISTOGRAM_TABLES][ASCII] = { { 0 } };
+
+    while (length > 0) {
+        size_t chunk = length < HISTOGRAM_CHUNK ? length : HISTOGRAM_CHUNK;
+        size_t i = 0;
+        for (; i + 16 <= chunk; i += 16) {
+            uint8x16_t v = vld1q_u8(data + i);
+            if (vminvq_u8(vceqq_u8(v, vdupq_n_u8(data[i]))) == 0xff) {
+                tables[0][data[i]] += 16;
+            } else {
+                histogram_count_16(data + i, tables);
+            }
+        }
+        for (; i < chunk; ++i) {
+            tables[i % HISTOGRAM_TABLES][data[i]]++;
+        }
+        histogram_merge(tables, appear_times);
+        data += chunk;
+        length -= chunk;
+    }
+}
+#endif
+
+static void (*histogram_kernel)(const unsigned char*, size_t, uint64_t[]) = histogram_scalar;
+static pthread_once_t histogram_kernel_once = PTHREAD_ONCE_INIT;
+
+static void histogram_kernel_init(void) {
+#if defined(HISTOGRAM_AVX2)
+    if (__builtin_cpu_supports("avx2")) histogram_kernel = histogram_avx2;
+#elif defined(HISTOGRAM_NEON)
+    histogram_kernel = histogram_neon;
+#endif
+}
+
+/**
+ * histogram_count function adds the appear times of data to appear_times with
+ * the best kernel of this CPU, the choice is made once at the first call.
+ */
+void histogram_count(const unsigned char* data, size_t length, uint64_t appear_times[]) {
+    STATS_BEGIN(start);
+    pthread_once(&histogram_kernel_once, histogram_kernel_init);
+    histogram_kernel(data, length, appear_times);
+    STATS_END(start, STATS_HISTOGRAM, length);
+}
+
+/**
+ * symbol_stats_update function adds the appear times of every byte in data to
+ * the histogram. Calling it block by block builds the histogram of the whole
+ * stream incrementally. The length is passed in explicitly, so it also works
+ * for binary data with embedded '\0'.
+ */
+void symbol_stats_update(SymbolStats* stats, const unsigned char* data, size_t length) {
+    histogram_count(data, length, stats->appear_times);
+    stats->length += length;
+}
+
+void symbol_stats_finish(SymbolStats* stats) {
+    stats->count = 0;
+    for (int i = 0; i < ASCII; ++i) {
+        if (stats->appear_times[i] != 0) {
+            stats->kind[stats->count++] = (unsigned char)i;
+        }
+    }
+}
+
+/**
+ * canonical_codes function replaces the codes in table by the canonical codes
+ * of the same lengths. Only the length of a code matters for the compression
+ * ratio, so the tree shape (which depends on how heapify breaks ties) can be
+ * forgotten: shorter codes come first, codes of the same length are given in
+ * symbol order, and every code is the previous one + 1.
+ *
+ *   lengths   a:2 b:1 c:3 d:3
+ *   sorted    b:1 a:2 c:3 d:3
+ *   codes     b:0 a:10 c:110 d:111
+ *
+ * So a decoder can rebuild every code from the n lengths alone. It returns
+ * -1 if the lengths are impossible (more codes than ∑ 2⁻ˡ ≤ 1 allows).
+ *
+ * It's inline for any alphabet, canonical_codes below is the one for bytes
+ * where n is the constant 256 (and the wide alphabets pass theirs).
+ */
+static inline int canonical_codes_n(HuffmanCode table[], size_t n) {
+    uint64_t length_count[MAX_CODE_LENGTH + 1] = { 0 };
+    uint64_t next_code[MAX_CODE_LENGTH + 1];
+
+    for (size_t i = 0; i < n; ++i) {
+        if (table[i].length < 0 || table[i].length > MAX_CODE_LENGTH) return -1;
+        length_count[table[i].length]++;
+    }
+    length_count[0] = 0;
+
+    uint64_t code = 0;
+    for (int length = 1; length <= MAX_CODE_LENGTH; ++length) {
+        code = (code + length_count[length - 1]) << 1;
+        next_code[length] = code;
+        if (length_count[length] > (1ull << length) - code) return -1;
+        // The codes of this length would need more than `length` bits
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        if (table[i].length > 0) {
+            table[i].bits = next_code[table[i].length]++;
+        } else {
+            table[i].bits = 0;
+        }
+    }
+    return 0;
+}
+
+int canonical_codes(HuffmanCode table[]) {
+    return canonical_codes_n(table, ASCII);
+}
+
+/**
+ * write_code_lengths function stores the 256 code lengths compactly, absent
+ * symbols are the common case so runs of 0 are merged:
+ *
+ *   0x00 - 0x7f  the code length of the next symbol
+ *   0x80 - 0xff  the next (byte - 0x7f) symbols, 1 to 128, have code length 0
+ *
+ * English text with ~70 symbols stores in about 80 bytes instead of 256. It
+ * returns the number of bytes written, at most MAX_LENGTHS_SIZE.
+ */
+size_t write_code_lengths(const HuffmanCode table[], unsigned char* out) {
+    size_t size = 0;
+    for (int i = 0; i < ASCII;) {
+        if (table[i].length != 0) {
+            out[size++] = (unsigned char)table[i].length;
+            i++;
+            continue;
+        }
+        int run = 0;
+        while (i + run < ASCII && table[i + run].length == 0 && run < 128) run++;
+        out[size++] = (unsigned char)(0x7f + run);
+        i += run;
+    }
+    return size;
+}
+
+/**
+ * read_code_lengths function is the inverse of write_code_lengths, it returns
+ * the number of bytes read or -1 if in is not a valid table.
+ */
+long read_code_lengths(const unsigned char* in, size_t size, HuffmanCode table[]) {
+    size_t pos = 0;
+    for (int i = 0; i < ASCII;) {
+        if (pos >= size) return -1;
+        unsigned char byte = in[pos++];
+        if (byte < 0x80) {
+            if (byte > MAX_CODE_LENGTH) return -1;
+            table[i].bits = 0;
+            table[i++].length = byte;
+            continue;
+        }
+        int run = byte - 0x7f;
+        if (i + run > ASCII) return -1;
+        for (int j = 0; j < run; ++j) {
+            table[i].bits = 0;
+            table[i++].length = 0;
+        }
+    }
+    return (long)pos;
+}
+
+int max_code_length(const SymbolStats* stats, const HuffmanCode table[]) {
+    int max_length = 0;
+    for (int i = 0; i < stats->count; ++i) {
+        if (table[stats->kind[i]].length > max_length) max_length = table[stats->kind[i]].length;
+    }
+    return max_length;
+}
+
+typedef struct {
+    uint64_t weight;
+    unsigned char symbol;
+} WeightedSymbol;
+
+/**
+ * sort_weighted_symbols function sorts at most ASCII symbols by weight with a
+ * least significant digit radix sort, one byte per pass. It's stable, so
+ * symbols of the same weight keep their (ascending) order. Only the bytes up
+ * to the highest one of the largest weight need a pass, usually 2 or 3 of
+ * them, which is several times faster than qsort with its comparator calls.
+ */
+static void sort_weighted_symbols(WeightedSymbol symbols[], int n) {
+    WeightedSymbol buffer[ASCII];
+    WeightedSymbol* from = symbols;
+    WeightedSymbol* to = buffer;
+    uint64_t largest = 0;
+
+    for (int i = 0; i < n; ++i) {
+        if (symbols[i].weight > largest) largest = symbols[i].weight;
+    }
+    for (int shift = 0; shift < 64 && (largest >> shift) != 0; shift += 8) {
+        int position[ASCII] = { 0 };
+        for (int i = 0; i < n; ++i) {
+            position[(from[i].weight >> shift) & 0xff]++;
+        }
+        int sum = 0;
+        for (int d = 0; d < ASCII; ++d) {
+            int count = position[d];
+            position[d] = sum;
+            sum += count;
+        }
+        for (int i = 0; i < n; ++i) {
+            to[position[(from[i].weight >> shift) & 0xff]++] = from[i];
+        }
+        WeightedSymbol* temp = from;
+        from = to;
+        to = temp;
+    }
+    if (from != symbols) memcpy(symbols, from, n * sizeof(WeightedSymbol));
+}
+
+/**
+ * package_merge function computes the optimal code lengths under the limit
+ * that no code is longer than max_bits (Larmore and Hirschberg).
+ *
+ * Think of a code of length l as l coins, one on each of the levels 1..l, and
+ * the coin of a symbol on every level is worth its weight. Choosing the
+ * lengths is choosing 2n - 2 coins of least total worth. From the deepest
+ * level up, the items of a level are merged into packages of two, and every
+ * package joins the coins of the level above:
+ *
+ *   level max_bits:  coins                        a b c d
+ *   level max_bits-1: coins + packages of level below   a b (ab) c d (cd)
+ *   ...
+ *   level 1: take the cheapest 2n - 2 items
+ *
+ * A package taken on level j means both of its items on level j + 1 are taken
+ * too, so going back down every level takes its cheapest 2 × packages items,
+ * and the length of a symbol is the number of levels where its coin is taken.
+ * The items are merged in weight order, so the coins taken on a level are
+ * always the cheapest ones and only the number of them has to be remembered.
+ *
+ * It returns -1 if n symbols don't fit in max_bits bits (n > 2^max_bits).
+ */
+static int package_merge(const SymbolStats* stats, int max_bits, HuffmanCode table[]) {
+    unsigned char is_package[MAX_CODE_LENGTH + 1][2 * ASCII];
+    uint64_t weights[2][2 * ASCII];
+    int list_size[MAX_CODE_LENGTH + 1];
+    WeightedSymbol leaves[ASCII];
+    int n = stats->count;
+
+    if (max_bits < 1 || max_bits > MAX_CODE_LENGTH) return -1;
+    if (max_bits < 63 && (uint64_t)n > (1ull << max_bits)) return -1;
+    for (int i = 0; i < n; ++i) {
+        leaves[i].weight = stats->appear_times[stats->kind[i]];
+        leaves[i].symbol = stats->kind[i];
+    }
+    sort_weighted_symbols(leaves, n);
+
+    uint64_t* previous = weights[0];
+    for (int i = 0; i < n; ++i) {
+        previous[i] = leaves[i].weight;
+        is_package[max_bits][i] = 0;
+    }
+    list_size[max_bits] = n;
+
+    for (int level = max_bits - 1; level >= 1; --level) {
+        uint64_t* current = weights[(max_bits - level) & 1];
+        int packages = list_size[level + 1] / 2;
+        int leaf = 0, package = 0, size = 0;
+        while (leaf < n || package < packages) {
+            uint64_t package_weight = package < packages ? previous[2 * package] + previous[2 * package + 1] : 0;
+            if (package >= packages || (leaf < n && leaves[leaf].weight <= package_weight)) {
+                current[size] = leaves[leaf++].weight;
+                is_package[level][size++] = 0;
+            } else {
+                current[size] = package_weight;
+                is_package[level][size++] = 1;
+                package++;
+            }
+        }
+        list_size[level] = size;
+        previous = current;
+    }
+
+    memset(table, 0, ASCII * sizeof(HuffmanCode));
+    int take = 2 * n - 2;
+    for (int level = 1; level <= max_bits && take > 0; ++level) {
+        int coins = 0, packages = 0;
+        for (int i = 0; i < take; ++i) {
+            if (is_package[level][i]) packages++;
+            else coins++;
+        }
+        for (int i = 0; i < coins; ++i) {
+            table[leaves[i].symbol].length++;
+        }
+        take = 2 * packages;
+    }
+    return 0;
+}
+
+/**
+ * huffman_lengths_inplace function computes the same optimal code lengths as
+ * build_huffman, but with the in-place algorithm of Moffat and Katajainen on
+ * the sorted weights: no tree, no heap, no pointer, only one array of at most
+ * 256 integers which is rewritten three times.
+ *
+ * 1. left to right: the classic two-queue merge. The leaves are the sorted
+ *    weights not used yet (from `leaf`), the inner nodes are created in
+ *    increasing weight order too, so they form the second queue (from `root`)
+ *    and the two smallest items are always at the heads of the queues. An
+ *    inner node is stored at A[next] and its children point to it by index.
+ * 2. right to left: A[n - 2] is the root, every inner node's depth is the
+ *    depth of its parent + 1.
+ * 3. right to left: on each depth, the slots which are not taken by inner
+ *    nodes are leaves, the heaviest leaves get the smallest depths.
+ *
+ * inplace_lengths does the three passes on n ≥ 2 sorted weights in A, which
+ * hold the depths afterwards. Nothing in it depends on the alphabet, so the
+ * wide alphabets build their codes with it too.
+ */
+static inline void inplace_lengths(uint64_t A[], long n) {
+    long root = 0, leaf = 2, next;
+    A[0] += A[1];
+    for (next = 1; next < n - 1; ++next) {
+        if (leaf >= n || A[root] < A[leaf]) {
+            A[next] = A[root];
+            A[root++] = next;
+        } else {
+            A[next] = A[leaf++];
+        }
+        if (leaf >= n || (root < next && A[root] < A[leaf])) {
+            A[next] += A[root];
+            A[root++] = next;
+        } else {
+            A[next] += A[leaf++];
+        }
+    }
+
+    A[n - 2] = 0;
+    for (next = n - 3; next >= 0; --next) {
+        A[next] = A[A[next]] + 1;
+    }
+
+    long available = 1, used = 0, depth = 0;
+    root = n - 2;
+    next = n - 1;
+    while (available > 0) {
+        while (root >= 0 && A[root] == (uint64_t)depth) {
+            used++;
+            root--;
+        }
+        while (available > used) {
+            A[next--] = depth;
+            available--;
+        }
+        available = 2 * used;
+        depth++;
+        used = 0;
+    }
+}
+
+static int huffman_lengths_inplace(const SymbolStats* stats, HuffmanCode table[]) {
+    WeightedSymbol leaves[ASCII];
+    uint64_t A[ASCII] = { 0 };
+    int n = stats->count;
+
+    memset(table, 0, ASCII * sizeof(HuffmanCode));
+    if (n == 0) return 0;
+    if (n == 1) return 0;
+    for (int i = 0; i < n; ++i) {
+        leaves[i].weight = stats->appear_times[stats->kind[i]];
+        leaves[i].symbol = stats->kind[i];
+    }
+    sort_weighted_symbols(leaves, n);
+    for (int i = 0; i < n; ++i) {
+        A[i] = leaves[i].weight;
+    }
+    inplace_lengths(A, n);
+
+    for (int i = 0; i < n; ++i) {
+        if (A[i] > MAX_CODE_LENGTH) return -1;
+        table[leaves[i].symbol].length = (int)A[i];
+    }
+    return 0;
+}
+
+/**
+ * huffman_lengths_heap function is the original way: build the tree with the
+ * min heap and read the code lengths from it.
+ */
+static int huffman_lengths_heap(const SymbolStats* stats, HuffmanCode table[]) {
+    unsigned char kind[ASCII];
+
+    memset(table, 0, ASCII * sizeof(HuffmanCode));
+    if (stats->count == 0) return 0;
+    for (int i = 0; i < stats->count; ++i) {
+        kind[i] = (unsigned char)stats->kind[i];
+    }
+
+    HuffmanTree tree;
+    build_huffman(&tree, kind, stats->appear_times, stats->count);
+    return huffman_code(&tree, table);
+}
+
+/**
+ * build_huffman_codes function computes the optimal code lengths with builder
+ * and stores the canonical code of every appeared symbol in table. If
+ * max_bits > 0 and a code is longer than max_bits, the lengths are computed
+ * again with package_merge. It returns -1 if a code is too long to be stored.
+ */
+int build_huffman_codes(const SymbolStats* stats, HuffmanBuilder builder, int max_bits, HuffmanCode table[]) {
+    if (stats->count == 0) {
+        memset(table, 0, ASCII * sizeof(HuffmanCode));
+        return 0;
+    }
+
+    STATS_BEGIN(start);
+    int too_long = (builder == BUILDER_INPLACE ? huffman_lengths_inplace(stats, table)
+                                               : huffman_lengths_heap(stats, table)) < 0;
+    if (max_bits > 0 && stats->count > 1 && (too_long || max_code_length(stats, table) > max_bits)) {
+        if (package_merge(stats, max_bits, table) < 0) return -1;
+        // stats->count symbols don't fit in codes of max_bits bits
+        too_long = 0;
+    }
+    STATS_END(start, STATS_BUILD, stats->length);
+    if (too_long) return -1;
+    if (stats->count == 1) {
+        table[stats->kind[0]].length = 1;
+        // The tree of one symbol is a single leaf and its code is empty, which
+        // can't be written to (or read back from) a bitstream. "0" can.
+    }
+    STATS_BEGIN(codes);
+    int status = canonical_codes(table);
+    STATS_END(codes, STATS_CODES, 0);
+    return status;
+}
+
+/**
+ * BitWriter packs codes into a 64 bits accumulator, the first bit of a code
+ * goes to the higher bit. When the accumulator is full the whole word is
+ * stored to out in big endian order, so the bytes in out read from left to
+ * right are exactly the "0101..." printed by print_huffman_encoding.
+ *
+ *   acc: [ .... older bits .... | newest code ]
+ *                               └── count ──┘ bits are pending
+ */
+typedef struct {
+    unsigned char* out;
+    size_t pos;
+    uint64_t acc;
+    int count;
+} BitWriter;
+
+static inline void store_be64(unsigned char* p, uint64_t x) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    memcpy(p, &x, 8);
+}
+
+static void bit_writer_init(BitWriter* writer, unsigned char* out) {
+    writer->out = out;
+    writer->pos = 0;
+    writer->acc = 0;
+    writer->count = 0;
+}
+
+/**
+ * bit_writer_put function appends the lowest length bits of bits, length can be
+ * 0 to 63 and the higher bits of bits must be 0.
+ */
+static inline void bit_writer_put(BitWriter* writer, uint64_t bits, int length) {
+    if (writer->count + length < 64) {
+        writer->acc = (writer->acc << length) | bits;
+        writer->count += length;
+        return;
+    }
+    int room = 64 - writer->count;
+    int rest = length - room;
+    // count + length >= 64 and length <= 63, so 1 <= room <= 63 and both
+    // shifts below are defined.
+    store_be64(writer->out + writer->pos, (writer->acc << room) | (bits >> rest));
+    writer->pos += 8;
+    writer->acc = bits & ((1ull << rest) - 1);
+    writer->count = rest;
+}
+
+/**
+ * bit_writer_flush function moves the pending whole bytes to out. If pad is set
+ * the last partial byte is also written with 0 bits filled in at the end.
+ */
+static void bit_writer_flush(BitWriter* writer, int pad) {
+    while (writer->count >= 8) {
+        writer->out[writer->pos++] = (unsigned char)(writer->acc >> (writer->count - 8));
+        writer->count -= 8;
+    }
+    writer->acc &= (1ull << writer->count) - 1;
+    if (pad && writer->count > 0) {
+        writer->out[writer->pos++] = (unsigned char)(writer->acc << (8 - writer->count));
+        writer->acc = 0;
+        writer->count = 0;
+    }
+}
+
+/**
+ * huffman_encode function is the packed version of print_huffman_encoding, one
+ * bit_writer_put per symbol and no formatting at all.
+ */
+static void huffman_encode(const unsigned char* data, size_t length, const HuffmanCode table[], BitWriter* writer) {
+    for (size_t i = 0; i < length; ++i) {
+        bit_writer_put(writer, table[data[i]].bits, table[data[i]].length);
+    }
+}
+
+/**
+ * HUFFMAN_ENCODE_KERNEL is huffman_encode putting the codes of group symbols
+ * at once, group codes of the longest length must fit in the 63 bits of a
+ * bit_writer_put. The bitstream is the same, only the puts are fewer.
+ */
+#define HUFFMAN_ENCODE_KERNEL(name, group, attributes)                                                    \
+    attributes static void name(const unsigned char* data, size_t length, const HuffmanCode table[],     \
+                                BitWriter* writer) {                                                      \
+        size_t i = 0;                                                                                     \
+        for (; i + (group) <= length; i += (group)) {                                                     \
+            uint64_t bits = 0;                                                                            \
+            int bits_length = 0;                                                                          \
+            for (int k = 0; k < (group); ++k) {                                                           \
+                const HuffmanCode* code = &table[data[i + k]];                                            \
+                bits = (bits << code->length) | code->bits;                                               \
+                bits_length += code->length;                                                              \
+            }                                                                                             \
+            bit_writer_put(writer, bits, bits_length);                                                    \
+        }                                                                                                 \
+        huffman_encode(data + i, length - i, table, writer);                                              \
+    }
+
+HUFFMAN_ENCODE_KERNEL(huffman_encode_4, 4, )
+HUFFMAN_ENCODE_KERNEL(huffman_encode_2, 2, )
+
+/**
+ * A block given as pieces (the struct iovec of entropy_*_block_vectors) is
+ * walked with a SegmentCursor: segment_seek puts it at an offset of the whole
+ * block, segment_next returns the longest contiguous piece from there (at
+ * most limit bytes) and moves past it. A kernel that keeps its state between
+ * calls (a BitWriter, a BitReader) then just runs on every piece in turn:
+ *
+ *   vectors:  [ 0 ..... 700 )[ 700 .. 1000 )[ 1000 ....... 2048 )
+ *   range [500, 1200):  [500, 700)  [700, 1000)  [1000, 1200)
+ */
+typedef struct {
+    const struct iovec* vector;
+    size_t offset;
+    // Into *vector
+} SegmentCursor;
+
+static void segment_seek(SegmentCursor* cursor, const struct iovec* vectors, size_t offset) {
+    while (offset > 0 && offset >= vectors->iov_len) {
+        offset -= vectors->iov_len;
+        vectors++;
+    }
+    cursor->vector = vectors;
+    cursor->offset = offset;
+}
+
+static inline size_t segment_next(SegmentCursor* cursor, size_t limit, unsigned char** piece) {
+    while (cursor->offset == cursor->vector->iov_len) {
+        cursor->vector++;
+        cursor->offset = 0;
+    }
+    size_t left = cursor->vector->iov_len - cursor->offset;
+    size_t length = left < limit ? left : limit;
+    *piece = (unsigned char*)cursor->vector->iov_base + cursor->offset;
+    cursor->offset += length;
+    return length;
+}
+
+/**
+ * huffman_encode_range function codes the block's bytes from `from` to `to`
+ * with encode (huffman_encode or one of its kernels).
+ */
+static void huffman_encode_range(void (*encode)(const unsigned char*, size_t, const HuffmanCode[], BitWriter*),
+                                 const struct iovec* vectors, size_t from, size_t to, const HuffmanCode table[],
+                                 BitWriter* writer) {
+    SegmentCursor cursor;
+    segment_seek(&cursor, vectors, from);
+    while (from < to) {
+        unsigned char* piece;
+        size_t length = segment_next(&cursor, to - from, &piece);
+        encode(piece, length, table, writer);
+        from += length;
+    }
+}
+
+/* calculate the information entropy using Shannon formula. It doesn't calculate
+ * its frequency in ASCII characters set though.
+ */
+double information_entropy(const SymbolStats* stats) {
+    if (stats->length == 0) {
+        return 0.0;
+    }
+    double entropy = 0.0;
+
+    for (int i = 0; i < stats->count; ++i) {
+        double frequency = (double)stats->appear_times[stats->kind[i]] / stats->length;
+        entropy -= frequency * log2(frequency);
+
+        // At first I use ℍ(x) = ∑ [f(xᵢ) * log₂(1 / f(xᵢ))] but here the
+        // precision of floating number will be lost two times! One for
+        // reciprocal and one for logarithm.
+    }
+
+    return entropy;
+}
+
+/* calculate the total information.
+ */
+double information_value(const SymbolStats* stats) {
+    if (stats->length == 0) {
+        return 0.0;
+    }
+    double information = 0.0;
+
+    for (int i = 0; i < stats->count; ++i) {
+        uint64_t times = stats->appear_times[stats->kind[i]];
+        information -= times * log2((double)times / stats->length);
+    }
+
+    return information;
+}
+
+static double log2_table[(1 << FAST_LOG2_BITS) + 1];
+static double clog2_table[CLOG2_TABLE_SIZE];
+static pthread_once_t log2_tables_once = PTHREAD_ONCE_INIT;
+
+static void log2_tables_init(void) {
+    for (int i = 0; i <= (1 << FAST_LOG2_BITS); ++i) {
+        log2_table[i] = log2(1.0 + (double)i / (1 << FAST_LOG2_BITS));
+    }
+    clog2_table[0] = 0.0;
+    for (int c = 1; c < CLOG2_TABLE_SIZE; ++c) {
+        clog2_table[c] = c * log2((double)c);
+    }
+}
+
+/**
+ * fast_log2 function is log2(x) for an integer x ≥ 1 without libm. With
+ * x = 2^e · m and 1 ≤ m < 2, e is the position of the highest bit and log2(m)
+ * is interpolated linearly between the two nearest points of log2_table:
+ *
+ *   m = 1.1011001010|0110...  →  log2(m) ≈ T[1011001010] + 0.0110... · (T[+1] - T[])
+ *         index (10 bits) ↑      ↑ fraction
+ *
+ * log2 is concave, so the line between two points is below it by at most
+ * h² / 8 · max|log2''(m)| = 2⁻²⁰ / (8 ln 2) ≈ 1.8 × 10⁻⁷, with the step
+ * h = 2⁻¹⁰ and |log2''(m)| = 1 / (m² ln 2) ≤ 1 / ln 2. log2_tables_init must
+ * have run before.
+ */
+static inline double fast_log2(uint64_t x) {
+    int e = 63 - __builtin_clzll(x);
+    uint64_t m = x << (63 - e);
+    // m has the highest bit set, then the FAST_LOG2_BITS bits of the index
+    uint32_t index = (uint32_t)(m >> (63 - FAST_LOG2_BITS)) & ((1u << FAST_LOG2_BITS) - 1);
+    double fraction = (double)((m << (1 + FAST_LOG2_BITS)) >> 32) * (1.0 / 4294967296.0);
+    return e + log2_table[index] + fraction * (log2_table[index + 1] - log2_table[index]);
+}
+
+static inline double count_log2(uint64_t c) {
+    return c < CLOG2_TABLE_SIZE ? clog2_table[c] : c * fast_log2(c);
+}
+
+/**
+ * information_value_fast function is the fast path of information_value for a
+ * raw histogram, it uses
+ *
+ *        ℍ · N = ∑ cᵢ · log₂(N / cᵢ) = N · log₂(N) - ∑ cᵢ · log₂(cᵢ)
+ *
+ * so there's no division per symbol, and every cᵢ · log₂(cᵢ) is a lookup in
+ * clog2_table (exact) for small counts or a fast_log2 otherwise. Every log₂
+ * is below the exact value by at most 1.8 × 10⁻⁷, so the entropy
+ * (information_entropy_fast) is off by less than 4 × 10⁻⁷ bits per symbol.
+ */
+double information_value_fast(const uint64_t appear_times[], uint64_t length) {
+    if (length == 0) return 0.0;
+    pthread_once(&log2_tables_once, log2_tables_init);
+
+    double sum = 0.0;
+    for (int i = 0; i < ASCII; ++i) {
+        sum += count_log2(appear_times[i]);
+        // count_log2(0) = 0, no branch needed for the missing symbols
+    }
+    double information = count_log2(length) - sum;
+    return information > 0.0 ? information : 0.0;
+    // A single symbol gives 0 - 0, rounding may leave a tiny negative value
+}
+
+double information_entropy_fast(const uint64_t appear_times[], uint64_t length) {
+    return length ? information_value_fast(appear_times, length) / length : 0.0;
+}
+
+/**
+ * RollingEntropy keeps the entropy of the last `window` bytes of a stream. The
+ * histogram only changes in two bins per byte (+1 for the byte coming in, -1
+ * for the one falling out of the window), and with
+ *
+ *   ℍ = log₂(n) - S / n,   S = ∑ cᵢ · log₂(cᵢ)
+ *
+ * S changes by the difference of two c · log₂(c) values of each bin, so
+ * every byte is O(1). S is kept in 32.32 fixed point integers from a table of
+ * c · log₂(c) for all c ≤ window: adding and removing the same integers
+ * always gives back the same sum, so unlike a running double it doesn't drift
+ * however long the stream is. Every table entry is rounded by at most 2⁻³³,
+ * so S / n is off by less than 2⁻³³ · 256 / n.
+ */
+#define ROLLING_FIXED_BITS 32
+
+int rolling_entropy_init(RollingEntropy* rolling, size_t window) {
+    memset(rolling, 0, sizeof(RollingEntropy));
+    if (window == 0 || window > MAX_ROLLING_WINDOW) return -1;
+    rolling->window = window;
+    rolling->ring = (unsigned char*)malloc(window);
+    rolling->clog2_fixed = (int64_t*)malloc((window + 1) * sizeof(int64_t));
+    if (!rolling->ring || !rolling->clog2_fixed) return -1;
+    for (size_t c = 0; c <= window; ++c) {
+        rolling->clog2_fixed[c] = c ? llround(c * log2((double)c) * (double)(1ull << ROLLING_FIXED_BITS)) : 0;
+    }
+    rolling->log2_window = log2((double)window);
+    return 0;
+}
+
+void rolling_entropy_free(RollingEntropy* rolling) {
+    free(rolling->ring);
+    free(rolling->clog2_fixed);
+    rolling->ring = NULL;
+    rolling->clog2_fixed = NULL;
+}
+
+/**
+ * rolling_entropy_push function moves the window one byte forward.
+ */
+void rolling_entropy_push(RollingEntropy* rolling, unsigned char symbol) {
+    const int64_t* f = rolling->clog2_fixed;
+    if (rolling->filled == rolling->window) {
+        unsigned char out = rolling->ring[rolling->head];
+        uint32_t c = rolling->appear_times[out]--;
+        rolling->sum += f[c - 1] - f[c];
+    } else {
+        rolling->filled++;
+    }
+    rolling->ring[rolling->head] = symbol;
+    rolling->head = rolling->head + 1 == rolling->window ? 0 : rolling->head + 1;
+    uint32_t c = rolling->appear_times[symbol]++;
+    rolling->sum += f[c + 1] - f[c];
+}
+
+double rolling_entropy_value(const RollingEntropy* rolling) {
+    size_t n = rolling->filled;
+    if (n == 0) return 0.0;
+    double log2_n = n == rolling->window ? rolling->log2_window : log2((double)n);
+    double entropy = log2_n - (double)rolling->sum / (double)(1ull << ROLLING_FIXED_BITS) / n;
+    return entropy > 0.0 ? entropy : 0.0;
+}
+
+int order1_stats_init(Order1Stats* stats) {
+    memset(stats->counts, 0, sizeof(stats->counts));
+    stats->totals = (uint64_t (*)[ASCII])calloc(ASCII, sizeof(*stats->totals));
+    stats->length = 0;
+    stats->pending = 0;
+    stats->previous = 0;
+    return stats->totals ? 0 : -1;
+}
+
+void order1_stats_free(Order1Stats* stats) {
+    free(stats->totals);
+    stats->totals = NULL;
+}
+
+static void order1_stats_spill(Order1Stats* stats) {
+    for (int p = 0; p < ASCII; ++p) {
+        for (int x = 0; x < ASCII; ++x) {
+            stats->totals[p][x] += stats->counts[p][x];
+        }
+    }
+    memset(stats->counts, 0, sizeof(stats->counts));
+    stats->pending = 0;
+}
+
+void order1_stats_update(Order1Stats* stats, const unsigned char* data, size_t length) {
+    unsigned char previous = stats->previous;
+    while (length > 0) {
+        size_t room = HISTOGRAM_CHUNK - stats->pending;
+        size_t chunk = length < room ? length : room;
+        for (size_t i = 0; i < chunk; ++i) {
+            stats->counts[previous][data[i]]++;
+            previous = data[i];
+        }
+        stats->pending += chunk;
+        stats->length += chunk;
+        if (stats->pending == HISTOGRAM_CHUNK) order1_stats_spill(stats);
+        data += chunk;
+        length -= chunk;
+    }
+    stats->previous = previous;
+}
+
+double order1_entropy(Order1Stats* stats) {
+    if (stats->length == 0) return 0.0;
+    pthread_once(&log2_tables_once, log2_tables_init);
+    order1_stats_spill(stats);
+
+    double information = 0.0;
+    for (int p = 0; p < ASCII; ++p) {
+        uint64_t row = 0;
+        for (int x = 0; x < ASCII; ++x) {
+            row += stats->totals[p][x];
+            information -= count_log2(stats->totals[p][x]);
+        }
+        information += count_log2(row);
+    }
+    return information > 0.0 ? information / stats->length : 0.0;
+}
+
+/**
+ * Order2Stats uses the two bytes before as the context. A full
+ * 2¹⁶ × 256 table would be 64 MiB of which real data touches a small part,
+ * so the (context, byte) pairs that actually appear live in an open
+ * addressing hash table instead. An entry packs the pair and its count in
+ * one 64 bits word, so a probe is a single load:
+ *
+ *   | key + 1 (25 bits) | count (39 bits) |      key = context << 8 | byte
+ *
+ * and 0 is an empty slot. The table doubles when it's half full, the totals
+ * of the 2¹⁶ contexts are kept aside in context_totals.
+ */
+#define ORDER2_COUNT_BITS 39
+#define ORDER2_INITIAL_BITS 12
+
+int order2_stats_init(Order2Stats* stats) {
+    stats->bits = ORDER2_INITIAL_BITS;
+    stats->used = 0;
+    stats->length = 0;
+    stats->context = 0;
+    stats->entries = (uint64_t*)calloc((size_t)1 << stats->bits, sizeof(uint64_t));
+    stats->context_totals = (uint64_t*)calloc(1 << 16, sizeof(uint64_t));
+    return stats->entries && stats->context_totals ? 0 : -1;
+}
+
+void order2_stats_free(Order2Stats* stats) {
+    free(stats->entries);
+    free(stats->context_totals);
+    stats->entries = NULL;
+    stats->context_totals = NULL;
+}
+
+static inline size_t order2_slot(uint32_t key, int bits) {
+    return (size_t)((key * 0x9E3779B1u) >> (32 - bits));
+    // Fibonacci hashing, the high bits of the product are the well mixed ones
+}
+
+/**
+ * order2_stats_grow function doubles the hash table, it returns -1 if there's
+ * no memory (the old table is still valid then).
+ */
+static int order2_stats_grow(Order2Stats* stats) {
+    int bits = stats->bits + 1;
+    uint64_t* entries = (uint64_t*)calloc((size_t)1 << bits, sizeof(uint64_t));
+    if (!entries) return -1;
+    size_t mask = ((size_t)1 << bits) - 1;
+    for (size_t i = 0; i < ((size_t)1 << stats->bits); ++i) {
+        uint64_t entry = stats->entries[i];
+        if (!entry) continue;
+        size_t slot = order2_slot((uint32_t)(entry >> ORDER2_COUNT_BITS) - 1, bits);
+        while (entries[slot]) {
+            slot = (slot + 1) & mask;
+        }
+        entries[slot] = entry;
+    }
+    free(stats->entries);
+    stats->entries = entries;
+    stats->bits = bits;
+    return 0;
+}
+
+int order2_stats_update(Order2Stats* stats, const unsigned char* data, size_t length) {
+    uint32_t context = stats->context;
+    for (size_t i = 0; i < length; ++i) {
+        uint32_t key = (context << 8) | data[i];
+        uint64_t tag = (uint64_t)(key + 1) << ORDER2_COUNT_BITS;
+        size_t mask = ((size_t)1 << stats->bits) - 1;
+        size_t slot = order2_slot(key, stats->bits);
+        while (stats->entries[slot] && (stats->entries[slot] & ~((1ull << ORDER2_COUNT_BITS) - 1)) != tag) {
+            slot = (slot + 1) & mask;
+        }
+        if (stats->entries[slot]) {
+            stats->entries[slot]++;
+        } else {
+            stats->entries[slot] = tag | 1;
+            if (++stats->used * 2 > ((size_t)1 << stats->bits) && order2_stats_grow(stats) < 0) {
+                stats->context = context;
+                return -1;
+            }
+        }
+        stats->context_totals[context]++;
+        context = key & 0xffff;
+    }
+    stats->context = context;
+    stats->length += length;
+    return 0;
+}
+
+double order2_entropy(const Order2Stats* stats) {
+    if (stats->length == 0) return 0.0;
+    pthread_once(&log2_tables_once, log2_tables_init);
+
+    double information = 0.0;
+    for (uint32_t c = 0; c < (1u << 16); ++c) {
+        information += count_log2(stats->context_totals[c]);
+    }
+    for (size_t i = 0; i < ((size_t)1 << stats->bits); ++i) {
+        information -= count_log2(stats->entries[i] & ((1ull << ORDER2_COUNT_BITS) - 1));
+    }
+    return information > 0.0 ? information / stats->length : 0.0;
+}
+
+/**
+ * BitReader is the mirror of BitWriter, acc holds the next bits of the stream
+ * from its highest bit, so the next n bits are always `acc >> (64 - n)`.
+ */
+typedef struct {
+    const unsigned char* p;
+    const unsigned char* end;
+    uint64_t acc;
+    int count;
+} BitReader;
+
+static inline uint64_t load_be64(const unsigned char* p) {
+    uint64_t x;
+    memcpy(&x, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    return x;
+}
+
+static void bit_reader_init(BitReader* reader, const unsigned char* p, const unsigned char* end) {
+    reader->p = p;
+    reader->end = end;
+    reader->acc = 0;
+    reader->count = 0;
+}
+
+/**
+ * bit_reader_refill function tops acc up to at least 56 valid bits. With 8 or
+ * more bytes left it's a single load: the bytes that only partly fit are not
+ * consumed, they are loaded again (with the same bits) next time.
+ */
+static inline void bit_reader_refill(BitReader* reader) {
+    if (reader->end - reader->p >= 8) {
+        reader->acc |= load_be64(reader->p) >> reader->count;
+        reader->p += (63 - reader->count) >> 3;
+        reader->count |= 56;
+    } else {
+        while (reader->count <= 56 && reader->p < reader->end) {
+            reader->acc |= (uint64_t)*reader->p++ << (56 - reader->count);
+            reader->count += 8;
+        }
+    }
+}
+
+static inline void bit_reader_consume(BitReader* reader, int length) {
+    reader->acc <<= length;
+    reader->count -= length;
+    // count goes below 0 only when the stream is truncated, the bits read then
+    // are 0 and the caller checks count at the end.
+}
+
+/**
+ * HuffmanDecoder decodes one symbol with one lookup: the next DECODE_TABLE_BITS
+ * bits index table, and every code with length ≤ DECODE_TABLE_BITS fills all
+ * the 2^(DECODE_TABLE_BITS - length) entries starting with it:
+ *
+ *   code "10" with DECODE_TABLE_BITS = 3  →  table[100] = table[101] = { symbol, 2 }
+ *
+ * An entry is (length << 8) | symbol, length 0 means the code is longer than
+ * the table. Then subtrees[prefix] is the node of tree reached after
+ * DECODE_TABLE_BITS bits (0 if none is) and the rest of the code is read bit
+ * by bit from there. Codes that long are rare because they belong to symbols
+ * that appear at most 2⁻¹¹ of the time.
+ */
+typedef struct {
+    uint16_t table[1 << DECODE_TABLE_BITS];
+    uint16_t subtrees[1 << DECODE_TABLE_BITS];
+    int max_length;
+    // The longest code, the tree is only built when it's over DECODE_TABLE_BITS
+    HuffmanTree tree;
+} HuffmanDecoder;
+
+/**
+ * huffman_tree_from_codes function rebuilds the Huffman tree from the codes, a
+ * decoder only has the code table. It returns -1 if a code is the prefix of
+ * another one, or if the codes need more nodes than a Huffman tree has (which
+ * only happens for incomplete codes no encoder here writes).
+ */
+static int huffman_tree_from_codes(HuffmanTree* tree, const HuffmanCode table[]) {
+    huffman_tree_reset(tree);
+    uint16_t root = huffman_tree_node(tree, -1);
+    for (int i = 0; i < ASCII; ++i) {
+        if (table[i].length == 0) continue;
+        uint16_t node = root;
+        for (int d = table[i].length - 1; d >= 0; --d) {
+            if (tree->nodes[node].symbol >= 0) return -1;
+            // node is already the leaf of another symbol
+            int b = (table[i].bits >> d) & 1;
+            if (!tree->nodes[node].child[b]) {
+                uint16_t child = huffman_tree_node(tree, -1);
+                if (!child) return -1;
+                tree->nodes[node].child[b] = child;
+            }
+            node = tree->nodes[node].child[b];
+        }
+        HuffmanNode* leaf = &tree->nodes[node];
+        if (leaf->child[0] || leaf->child[1] || leaf->symbol >= 0) return -1;
+        leaf->symbol = (int16_t)i;
+    }
+    huffman_tree_flatten(tree, root);
+    return 0;
+}
+
+static int huffman_decoder_init(HuffmanDecoder* decoder, const HuffmanCode table[]) {
+    memset(decoder->table, 0, sizeof(decoder->table));
+    memset(decoder->subtrees, 0, sizeof(decoder->subtrees));
+    decoder->max_length = 0;
+
+    for (int i = 0; i < ASCII; ++i) {
+        if (table[i].length > decoder->max_length) decoder->max_length = table[i].length;
+        if (table[i].length == 0 || table[i].length > DECODE_TABLE_BITS) continue;
+        int shift = DECODE_TABLE_BITS - table[i].length;
+        uint32_t first = (uint32_t)table[i].bits << shift;
+        for (uint32_t j = 0; j < (1u << shift); ++j) {
+            decoder->table[first + j] = (uint16_t)((table[i].length << 8) | i);
+        }
+    }
+    if (decoder->max_length <= DECODE_TABLE_BITS) return 0;
+    // With canonical codes the table alone is enough unless a code is longer
+
+    if (huffman_tree_from_codes(&decoder->tree, table) < 0) return -1;
+    const HuffmanNode* nodes = decoder->tree.nodes;
+    for (uint32_t prefix = 0; prefix < (1u << DECODE_TABLE_BITS); ++prefix) {
+        if (decoder->table[prefix] != 0) continue;
+        uint16_t node = 0;
+        for (int d = DECODE_TABLE_BITS - 1; d >= 0; --d) {
+            node = nodes[node].child[(prefix >> d) & 1];
+            if (!node) break;
+        }
+        decoder->subtrees[prefix] = node;
+        // 0 if no code starts with prefix, the stream is corrupted then
+    }
+    return 0;
+}
+
+/**
+ * huffman_decode_slow function walks the tree for a code longer than the
+ * table, the next bit is the index of the child to go to.
+ */
+static int huffman_decode_slow(const HuffmanDecoder* decoder, BitReader* reader) {
+    const HuffmanNode* nodes = decoder->tree.nodes;
+    uint16_t node = decoder->subtrees[reader->acc >> (64 - DECODE_TABLE_BITS)];
+    if (!node) return -1;
+    bit_reader_consume(reader, DECODE_TABLE_BITS);
+    while (nodes[node].symbol < 0) {
+        if (reader->count <= 0) bit_reader_refill(reader);
+        node = nodes[node].child[reader->acc >> 63];
+        bit_reader_consume(reader, 1);
+        if (!node) return -1;
+    }
+    return nodes[node].symbol;
+}
+
+/**
+ * huffman_decode function decodes up to length symbols to out. Unless final is
+ * set, it stops when fewer than 16 bytes of input are left, so the caller can
+ * read more input; 16 bytes always hold the longest code plus a refill. It
+ * returns the number of symbols decoded or -1 if the stream is corrupted.
+ */
+static inline int huffman_decode_symbol(const HuffmanDecoder* decoder, BitReader* reader) {
+    uint16_t entry = decoder->table[reader->acc >> (64 - DECODE_TABLE_BITS)];
+    if (entry >> 8) {
+        bit_reader_consume(reader, entry >> 8);
+        return (unsigned char)entry;
+    }
+    return huffman_decode_slow(decoder, reader);
+}
+
+static long huffman_decode(const HuffmanDecoder* decoder, BitReader* reader, unsigned char* out, size_t length, int final) {
+    size_t i = 0;
+    for (; i < length && (final || reader->end - reader->p >= 16); ++i) {
+        bit_reader_refill(reader);
+        int symbol = huffman_decode_symbol(decoder, reader);
+        if (symbol < 0) return -1;
+        out[i] = (unsigned char)symbol;
+    }
+    if (reader->count < 0) return -1;
+    return (long)i;
+}
+
+/**
+ * huffman_decode4 function decodes HUFFMAN_STREAMS bitstreams at once, stream
+ * k has the symbols from starts[k] to starts[k + 1] of out. Decoding a symbol
+ * has to wait for the length of the previous one, so a single stream is a
+ * chain of dependent loads and shifts; 4 independent chains in the same loop
+ * keep the other execution units of the core busy meanwhile.
+ *
+ * This one is for codes longer than the table: a symbol may need the tree
+ * and every stream is refilled before every symbol. The interleaved loop goes
+ * on while every stream can take a fast refill and has symbols to decode,
+ * huffman_decode4_tails then finishes the streams one after another.
+ */
+static int huffman_decode4_tails(const HuffmanDecoder* decoder, BitReader readers[], unsigned char* out,
+                                 const size_t pos[], const size_t starts[]) {
+    for (int k = 0; k < HUFFMAN_STREAMS; ++k) {
+        size_t rest = starts[k + 1] - pos[k];
+        if (huffman_decode(decoder, &readers[k], out + pos[k], rest, 1) != (long)rest) return -1;
+    }
+    return 0;
+}
+
+static size_t huffman_decode4_rounds(const size_t starts[], size_t pos[]) {
+    size_t rounds = starts[4] - starts[3];
+    for (int k = 0; k < HUFFMAN_STREAMS; ++k) {
+        pos[k] = starts[k];
+        if (starts[k + 1] - starts[k] < rounds) rounds = starts[k + 1] - starts[k];
+    }
+    return rounds;
+}
+
+static int huffman_decode4(const HuffmanDecoder* decoder, BitReader readers[], unsigned char* out, const size_t starts[]) {
+    size_t pos[HUFFMAN_STREAMS];
+    size_t rounds = huffman_decode4_rounds(starts, pos);
+    BitReader r0 = readers[0], r1 = readers[1], r2 = readers[2], r3 = readers[3];
+    // Local copies of the readers stay in registers, through the array the
+    // compiler would have to assume out aliases them
+
+    for (size_t n = 0; n < rounds; ++n) {
+        if (r0.end - r0.p < 8 || r1.end - r1.p < 8 || r2.end - r2.p < 8 || r3.end - r3.p < 8) break;
+        bit_reader_refill(&r0);
+        bit_reader_refill(&r1);
+        bit_reader_refill(&r2);
+        bit_reader_refill(&r3);
+        int s0 = huffman_decode_symbol(decoder, &r0);
+        int s1 = huffman_decode_symbol(decoder, &r1);
+        int s2 = huffman_decode_symbol(decoder, &r2);
+        int s3 = huffman_decode_symbol(decoder, &r3);
+        if ((s0 | s1 | s2 | s3) < 0) return -1;
+        out[pos[0]++] = (unsigned char)s0;
+        out[pos[1]++] = (unsigned char)s1;
+        out[pos[2]++] = (unsigned char)s2;
+        out[pos[3]++] = (unsigned char)s3;
+    }
+    readers[0] = r0, readers[1] = r1, readers[2] = r2, readers[3] = r3;
+    return huffman_decode4_tails(decoder, readers, out, pos, starts);
+}
+
+/**
+ * When no code is longer than the table, the loops above are mostly
+ * overhead: after a refill there are at least 56 bits, that's 5 symbols when
+ * no code is longer than 11 bits and 4 symbols up to 12, so one check and one
+ * refill cover a whole group of lookups, and no lookup can need the tree.
+ * The kernels below are these loops with the group size (and so the longest
+ * code) fixed when they're compiled, one function per combination:
+ *
+ *   HUFFMAN_DECODE_KERNEL    1 stream,  5 or 4 symbols per refill
+ *   HUFFMAN_DECODE4_KERNEL   4 streams, 5 or 4 symbols per refill
+ *   HUFFMAN_ENCODE_KERNEL    4 codes of ≤ 15 bits or 2 of ≤ 31 bits a put
+ *
+ * and each of them once more with target("bmi2") on x86, where every
+ * variable shift of the bit reader and writer becomes a single shrx / shlx
+ * (no cl register, no flags). huffman_kernels is the set the CPU runs best,
+ * huffman_decode_any, huffman_decode4_any and huffman_encode_kernel pick the
+ * kernel of a table by its longest code. pext isn't used: the codes are read
+ * from the top of the accumulator, which is a plain shift.
+ */
+static inline unsigned char huffman_decode_entry(const uint16_t* table, BitReader* reader) {
+    uint16_t entry = table[reader->acc >> (64 - DECODE_TABLE_BITS)];
+    bit_reader_consume(reader, entry >> 8);
+    return (unsigned char)entry;
+}
+
+#define HUFFMAN_DECODE_KERNEL(name, symbols, attributes)                                                  \
+    attributes static long name(const HuffmanDecoder* decoder, BitReader* reader, unsigned char* out,    \
+                                size_t length) {                                                          \
+        const uint16_t* table = decoder->table;                                                           \
+        BitReader r = *reader;                                                                            \
+        size_t i = 0;                                                                                     \
+        for (; length - i >= (symbols) && r.end - r.p >= 8; i += (symbols)) {                             \
+            bit_reader_refill(&r);                                                                        \
+            for (int k = 0; k < (symbols); ++k) {                                                         \
+                out[i + k] = huffman_decode_entry(table, &r);                                             \
+            }                                                                                             \
+        }                                                                                                 \
+        *reader = r;                                                                                      \
+        long rest = huffman_decode(decoder, reader, out + i, length - i, 1);                              \
+        return rest < 0 ? -1 : (long)i + rest;                                                            \
+    }
+
+#define HUFFMAN_DECODE4_KERNEL(name, symbols, attributes)                                                 \
+    attributes static int name(const HuffmanDecoder* decoder, BitReader readers[], unsigned char* out,   \
+                               const size_t starts[]) {                                                   \
+        size_t pos[HUFFMAN_STREAMS];                                                                      \
+        size_t rounds = huffman_decode4_rounds(starts, pos);                                              \
+        const uint16_t* table = decoder->table;                                                           \
+        BitReader r0 = readers[0], r1 = readers[1], r2 = readers[2], r3 = readers[3];                     \
+        for (size_t n = 0; n < rounds / (symbols); ++n) {                                                 \
+            if (r0.end - r0.p < 8 || r1.end - r1.p < 8 || r2.end - r2.p < 8 || r3.end - r3.p < 8) break; \
+            bit_reader_refill(&r0);                                                                       \
+            bit_reader_refill(&r1);                                                                       \
+            bit_reader_refill(&r2);                                                                       \
+            bit_reader_refill(&r3);                                                                       \
+            for (int step = 0; step < (symbols); ++step) {                                                \
+                out[pos[0]++] = huffman_decode_entry(table, &r0);                                         \
+                out[pos[1]++] = huffman_decode_entry(table, &r1);                                         \
+                out[pos[2]++] = huffman_decode_entry(table, &r2);                                         \
+                out[pos[3]++] = huffman_decode_entry(table, &r3);                                         \
+            }                                                                                             \
+        }                                                                                                 \
+        readers[0] = r0, readers[1] = r1, readers[2] = r2, readers[3] = r3;                               \
+        return huffman_decode4_tails(decoder, readers, out, pos, starts);                                 \
+    }
+
+HUFFMAN_DECODE_KERNEL(huffman_decode_5, 5, )
+HUFFMAN_DECODE_KERNEL(huffman_decode_4, 4, )
+HUFFMAN_DECODE4_KERNEL(huffman_decode4_5, 5, )
+HUFFMAN_DECODE4_KERNEL(huffman_decode4_4, 4, )
+#if defined(KERNELS_BMI2)
+HUFFMAN_DECODE_KERNEL(huffman_decode_5_bmi2, 5, __attribute__((target("bmi2"))))
+HUFFMAN_DECODE_KERNEL(huffman_decode_4_bmi2, 4, __attribute__((target("bmi2"))))
+HUFFMAN_DECODE4_KERNEL(huffman_decode4_5_bmi2, 5, __attribute__((target("bmi2"))))
+HUFFMAN_DECODE4_KERNEL(huffman_decode4_4_bmi2, 4, __attribute__((target("bmi2"))))
+HUFFMAN_ENCODE_KERNEL(huffman_encode_4_bmi2, 4, __attribute__((target("bmi2"))))
+HUFFMAN_ENCODE_KERNEL(huffman_encode_2_bmi2, 2, __attribute__((target("bmi2"))))
+#endif
+
+typedef void (*HuffmanEncodeKernel)(const unsigned char*, size_t, const HuffmanCode[], BitWriter*);
+
+typedef struct {
+    long (*decode[2])(const HuffmanDecoder*, BitReader*, unsigned char*, size_t);
+    int (*decode4[2])(const HuffmanDecoder*, BitReader[], unsigned char*, const size_t[]);
+    HuffmanEncodeKernel encode[2];
+    // [0] for the shortest codes: 5 symbols or 4 codes at a time
+} HuffmanKernels;
+
+static const HuffmanKernels huffman_kernels_generic = {
+    { huffman_decode_5, huffman_decode_4 },
+    { huffman_decode4_5, huffman_decode4_4 },
+    { huffman_encode_4, huffman_encode_2 },
+};
+#if defined(KERNELS_BMI2)
+static const HuffmanKernels huffman_kernels_bmi2 = {
+    { huffman_decode_5_bmi2, huffman_decode_4_bmi2 },
+    { huffman_decode4_5_bmi2, huffman_decode4_4_bmi2 },
+    { huffman_encode_4_bmi2, huffman_encode_2_bmi2 },
+};
+#endif
+static const HuffmanKernels* huffman_kernels = &huffman_kernels_generic;
+static pthread_once_t huffman_kernels_once = PTHREAD_ONCE_INIT;
+
+static void huffman_kernels_init(void) {
+#if defined(KERNELS_BMI2)
+    if (__builtin_cpu_supports("bmi2")) huffman_kernels = &huffman_kernels_bmi2;
+#endif
+}
+
+static const HuffmanKernels* huffman_kernels_get(void) {
+    pthread_once(&huffman_kernels_once, huffman_kernels_init);
+    return huffman_kernels;
+}
+
+/**
+ * huffman_decode_any and huffman_decode4_any functions decode like
+ * huffman_decode (with final set) and huffman_decode4 with the fastest kernel
+ * for the longest code of decoder.
+ */
+static long huffman_decode_any(const HuffmanDecoder* decoder, BitReader* reader, unsigned char* out, size_t length) {
+    if (decoder->max_length > DECODE_TABLE_BITS) return huffman_decode(decoder, reader, out, length, 1);
+    return huffman_kernels_get()->decode[decoder->max_length > 11](decoder, reader, out, length);
+}
+
+static int huffman_decode4_any(const HuffmanDecoder* decoder, BitReader readers[], unsigned char* out,
+                               const size_t starts[]) {
+    if (decoder->max_length > DECODE_TABLE_BITS) return huffman_decode4(decoder, readers, out, starts);
+    return huffman_kernels_get()->decode4[decoder->max_length > 11](decoder, readers, out, starts);
+}
+
+/**
+ * huffman_encode_kernel function returns the encoder kernel for codes of at
+ * most max_length bits.
+ */
+static HuffmanEncodeKernel huffman_encode_kernel(int max_length) {
+    if (max_length > 31) return huffman_encode;
+    return huffman_kernels_get()->encode[max_length > 15];
+}
+
+/**
+ * huffman_decode_range function decodes the symbols from `from` to `to` of the
+ * block to the pieces of vectors, it returns -1 if the stream is corrupted.
+ */
+static int huffman_decode_range(const HuffmanDecoder* decoder, BitReader* reader, const struct iovec* vectors,
+                                size_t from, size_t to) {
+    SegmentCursor cursor;
+    segment_seek(&cursor, vectors, from);
+    while (from < to) {
+        unsigned char* piece;
+        size_t length = segment_next(&cursor, to - from, &piece);
+        if (huffman_decode_any(decoder, reader, piece, length) != (long)length) return -1;
+        from += length;
+    }
+    return 0;
+}
+
+/**
+ * The wide alphabets keep their counts in one of two layouts:
+ *
+ *   dense    appear_times[symbol], capacity = alphabet ≤ WIDE_DENSE_ALPHABET
+ *   hashed   open addressing on symbols[], capacity a power of 2 kept at most
+ *            half full, a slot with appear_times 0 is empty
+ *
+ * The hashed one only grows with the distinct symbols, a file of 32-bit ids
+ * with 10⁴ different ones takes 2¹⁵ slots and not 2³² counters.
+ */
+#define WIDE_HASH_MIN_BITS 10
+
+static inline size_t wide_hash(uint32_t symbol, size_t capacity) {
+    return (size_t)(((uint64_t)symbol * 0x9e3779b97f4a7c15ull) >> 32) & (capacity - 1);
+}
+
+/**
+ * wide_slot function returns the slot of symbol, or the empty slot where it
+ * would go in a hashed table.
+ */
+static inline size_t wide_slot(const WideStats* stats, uint32_t symbol) {
+    if (!stats->symbols) return symbol;
+    size_t slot = wide_hash(symbol, stats->capacity);
+    while (stats->appear_times[slot] && stats->symbols[slot] != symbol) {
+        slot = (slot + 1) & (stats->capacity - 1);
+    }
+    return slot;
+}
+
+int wide_stats_init(WideStats* stats, uint64_t alphabet) {
+    memset(stats, 0, sizeof(WideStats));
+    if (alphabet < 2 || alphabet > (1ull << 32)) return -1;
+    stats->alphabet = alphabet;
+    stats->capacity = alphabet <= WIDE_DENSE_ALPHABET ? (size_t)alphabet : (size_t)1 << WIDE_HASH_MIN_BITS;
+    stats->appear_times = (uint64_t*)calloc(stats->capacity, sizeof(uint64_t));
+    if (alphabet > WIDE_DENSE_ALPHABET) stats->symbols = (uint32_t*)malloc(stats->capacity * sizeof(uint32_t));
+    if (!stats->appear_times || (alphabet > WIDE_DENSE_ALPHABET && !stats->symbols)) {
+        wide_stats_free(stats);
+        return -1;
+    }
+    return 0;
+}
+
+void wide_stats_free(WideStats* stats) {
+    free(stats->appear_times);
+    free(stats->symbols);
+    free(stats->ranks);
+    free(stats->kind);
+    memset(stats, 0, sizeof(WideStats));
+}
+
+/**
+ * wide_stats_grow function doubles a hashed table and puts every symbol in
+ * again.
+ */
+static int wide_stats_grow(WideStats* stats) {
+    WideStats grown = *stats;
+    grown.capacity = 2 * stats->capacity;
+    grown.appear_times = (uint64_t*)calloc(grown.capacity, sizeof(uint64_t));
+    grown.symbols = (uint32_t*)malloc(grown.capacity * sizeof(uint32_t));
+    if (!grown.appear_times || !grown.symbols) {
+        free(grown.appear_times);
+        free(grown.symbols);
+        return -1;
+    }
+    for (size_t slot = 0; slot < stats->capacity; ++slot) {
+        if (!stats->appear_times[slot]) continue;
+        size_t to = wide_slot(&grown, stats->symbols[slot]);
+        grown.symbols[to] = stats->symbols[slot];
+        grown.appear_times[to] = stats->appear_times[slot];
+    }
+    free(stats->appear_times);
+    free(stats->symbols);
+    *stats = grown;
+    return 0;
+}
+
+int wide_stats_update(WideStats* stats, const uint32_t* symbols, size_t length) {
+    if (!stats->symbols) {
+        for (size_t i = 0; i < length; ++i) {
+            if (symbols[i] >= stats->alphabet) return -1;
+            stats->appear_times[symbols[i]]++;
+        }
+        stats->length += length;
+        return 0;
+    }
+    for (size_t i = 0; i < length; ++i) {
+        if (symbols[i] >= stats->alphabet) return -1;
+        size_t slot = wide_slot(stats, symbols[i]);
+        if (!stats->appear_times[slot]) {
+            if (2 * (stats->count + 1) > stats->capacity) {
+                if (wide_stats_grow(stats) < 0) return -1;
+                slot = wide_slot(stats, symbols[i]);
+            }
+            stats->symbols[slot] = symbols[i];
+            stats->count++;
+        }
+        stats->appear_times[slot]++;
+        stats->length++;
+    }
+    return 0;
+}
+
+static int compare_wide_keys(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * wide_stats_finish function lists the appeared symbols in kind, in symbol
+ * order, and gives every slot its rank in that list.
+ */
+int wide_stats_finish(WideStats* stats) {
+    free(stats->kind);
+    free(stats->ranks);
+    stats->ranks = (uint32_t*)malloc(stats->capacity * sizeof(uint32_t));
+    uint64_t* keys = (uint64_t*)malloc((stats->capacity + 1) * sizeof(uint64_t));
+    stats->kind = NULL;
+    size_t count = 0;
+    for (size_t slot = 0; keys && slot < stats->capacity; ++slot) {
+        if (!stats->appear_times[slot]) continue;
+        uint64_t symbol = stats->symbols ? stats->symbols[slot] : slot;
+        keys[count++] = symbol << 32 | slot;
+        // Either one fits in 32 bits: a hashed table never has 2³² slots
+    }
+    if (stats->symbols) qsort(keys, count, sizeof(uint64_t), compare_wide_keys);
+    stats->kind = keys ? (uint32_t*)malloc((count + 1) * sizeof(uint32_t)) : NULL;
+    if (!stats->ranks || !stats->kind) {
+        free(keys);
+        return -1;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        stats->kind[i] = (uint32_t)(keys[i] >> 32);
+        stats->ranks[(uint32_t)keys[i]] = (uint32_t)i;
+    }
+    stats->count = count;
+    free(keys);
+    return 0;
+}
+
+uint64_t wide_stats_appear_times(const WideStats* stats, uint32_t symbol) {
+    if (symbol >= stats->alphabet) return 0;
+    return stats->appear_times[wide_slot(stats, symbol)];
+}
+
+double wide_entropy(const WideStats* stats) {
+    if (stats->length == 0) return 0.0;
+    double information = 0.0;
+    for (size_t slot = 0; slot < stats->capacity; ++slot) {
+        uint64_t c = stats->appear_times[slot];
+        if (c) information -= (double)c * log2((double)c / stats->length);
+    }
+    return information / stats->length;
+}
+
+static int compare_weighted_ranks(const void* a, const void* b) {
+    const uint64_t* x = (const uint64_t*)a;
+    const uint64_t* y = (const uint64_t*)b;
+    if (x[0] != y[0]) return x[0] < y[0] ? -1 : 1;
+    return x[1] < y[1] ? -1 : x[1] > y[1];
+}
+
+/**
+ * build_wide_codes function is build_huffman_codes for a wide alphabet, codes
+ * has stats->count entries in the order of kind. The weights are sorted with
+ * qsort (there can be far more of them than the 256 of the radix sort) and the
+ * lengths come from inplace_lengths, a heap of 10⁵ nodes would only be
+ * slower. It returns -1 if a code is longer than WIDE_MAX_CODE_LENGTH or
+ * there's no memory.
+ */
+int build_wide_codes(const WideStats* stats, HuffmanCode codes[]) {
+    size_t n = stats->count;
+    memset(codes, 0, n * sizeof(HuffmanCode));
+    if (n <= 1) {
+        if (n == 1) codes[0].length = 1;
+        return 0;
+    }
+
+    STATS_BEGIN(start);
+    uint64_t* leaves = (uint64_t*)malloc(2 * n * sizeof(uint64_t));
+    uint64_t* A = (uint64_t*)malloc(n * sizeof(uint64_t));
+    if (!leaves || !A) {
+        free(leaves);
+        free(A);
+        return -1;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        leaves[2 * i] = stats->appear_times[wide_slot(stats, stats->kind[i])];
+        leaves[2 * i + 1] = i;
+    }
+    qsort(leaves, n, 2 * sizeof(uint64_t), compare_weighted_ranks);
+    for (size_t i = 0; i < n; ++i) {
+        A[i] = leaves[2 * i];
+    }
+    inplace_lengths(A, (long)n);
+    int status = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (A[i] > WIDE_MAX_CODE_LENGTH) status = -1;
+        codes[leaves[2 * i + 1]].length = (int)A[i];
+    }
+    free(leaves);
+    free(A);
+    STATS_END(start, STATS_BUILD, stats->length);
+    if (status < 0) return -1;
+
+    STATS_BEGIN(codes_start);
+    status = canonical_codes_n(codes, n);
+    STATS_END(codes_start, STATS_CODES, 0);
+    return status;
+}
+
+uint64_t wide_coded_bits(const WideStats* stats, const HuffmanCode codes[]) {
+    uint64_t bits = 0;
+    for (size_t i = 0; i < stats->count; ++i) {
+        bits += stats->appear_times[wide_slot(stats, stats->kind[i])] * codes[i].length;
+    }
+    return bits;
+}
+
+/**
+ * wide_encode function writes the codes of symbols as one bitstream, like
+ * huffman_encode. out needs room for wide_coded_bits / 8 + 8 bytes of the
+ * counted symbols. It returns the bytes written, or -1 if a symbol wasn't
+ * counted in stats.
+ */
+long wide_encode(const WideStats* stats, const HuffmanCode codes[], const uint32_t* symbols, size_t length,
+                 unsigned char* out) {
+    BitWriter writer;
+    bit_writer_init(&writer, out);
+    for (size_t i = 0; i < length; ++i) {
+        if (symbols[i] >= stats->alphabet) return -1;
+        size_t slot = wide_slot(stats, symbols[i]);
+        if (!stats->appear_times[slot]) return -1;
+        const HuffmanCode* code = &codes[stats->ranks[slot]];
+        bit_writer_put(&writer, code->bits, code->length);
+    }
+    bit_writer_flush(&writer, 1);
+    return (long)writer.pos;
+}
+
+/**
+ * wide_decoder_init function sorts the symbols by code, which for canonical
+ * codes is by (length, symbol). Then the codes of one length are consecutive
+ * numbers from first[j] and the one that's next in the stream is found by
+ * comparing the next 64 bits with the last code of every length, aligned to
+ * the left, in one pass over the lengths used:
+ *
+ *   limit[j] = ((first[j] + count of length j) << (64 - length j)) - 1
+ *
+ * A table lookup like HuffmanDecoder would need 2^length entries per length.
+ */
+int wide_decoder_init(WideDecoder* decoder, const uint32_t kind[], const HuffmanCode codes[], size_t count) {
+    uint32_t length_count[WIDE_MAX_CODE_LENGTH + 1] = { 0 };
+    memset(decoder, 0, sizeof(WideDecoder));
+    for (size_t i = 0; i < count; ++i) {
+        if (codes[i].length < 1 || codes[i].length > WIDE_MAX_CODE_LENGTH) return -1;
+        length_count[codes[i].length]++;
+    }
+    decoder->symbols = (uint32_t*)malloc((count + 1) * sizeof(uint32_t));
+    if (!decoder->symbols) return -1;
+
+    uint32_t next[WIDE_MAX_CODE_LENGTH + 1];
+    uint64_t code = 0;
+    uint32_t offset = 0;
+    for (int length = 1; length <= WIDE_MAX_CODE_LENGTH; ++length) {
+        code = (code + length_count[length - 1]) << 1;
+        next[length] = offset;
+        if (!length_count[length]) continue;
+        if (length_count[length] > (1ull << length) - code) {
+            wide_decoder_free(decoder);
+            return -1;
+        }
+        int j = decoder->lengths++;
+        decoder->length[j] = length;
+        decoder->first[j] = code;
+        decoder->offset[j] = offset;
+        decoder->limit[j] = ((code + length_count[length]) << (64 - length)) - 1;
+        offset += length_count[length];
+    }
+    for (size_t i = 0; i < count; ++i) {
+        decoder->symbols[next[codes[i].length]++] = kind[i];
+    }
+    return 0;
+}
+
+void wide_decoder_free(WideDecoder* decoder) {
+    free(decoder->symbols);
+    decoder->symbols = NULL;
+}
+
+/**
+ * wide_decode function decodes length symbols of the bitstream in to out. It
+ * returns length, or -1 if the stream is corrupted or too short.
+ */
+long wide_decode(const WideDecoder* decoder, const unsigned char* in, size_t size, uint32_t* out, size_t length) {
+    BitReader reader;
+    bit_reader_init(&reader, in, in + size);
+    int last = decoder->lengths - 1;
+    if (last < 0) return length ? -1 : 0;
+    for (size_t i = 0; i < length; ++i) {
+        bit_reader_refill(&reader);
+        int j = 0;
+        while (j < last && reader.acc > decoder->limit[j]) j++;
+        if (reader.acc > decoder->limit[j]) return -1;
+        // Bits no code starts with, the code of one symbol is "0" alone
+        int bits = decoder->length[j];
+        out[i] = decoder->symbols[decoder->offset[j] + ((reader.acc >> (64 - bits)) - decoder->first[j])];
+        bit_reader_consume(&reader, bits);
+        if (reader.count < 0) return -1;
+    }
+    return (long)length;
+}
+
+/**
+ * tANS (table-based asymmetric numeral systems, the coder of FSE and zstd) is
+ * the second engine. Huffman gives every symbol a whole number of bits, so a
+ * symbol of probability 0.9 still costs 1 bit where its information is 0.15
+ * bits. tANS keeps a state x in [L, 2L), L = 2^table_log, and a symbol of
+ * normalized frequency f (out of L) costs log₂(L / f) bits on average,
+ * fractions included:
+ *
+ * 1. tans_normalize scales the histogram to frequencies that add up to L.
+ * 2. tans_spread spreads every symbol s over f_s of the L slots, a slot is a
+ *    state and the symbols are spread evenly so their states mix well.
+ * 3. The encoder goes through the block backwards. For symbol s in state x it
+ *    writes the low nb bits of x such that x >> nb ∈ [f, 2f), and the next x
+ *    is L + the slot of the (x >> nb - f)-th occurrence of s.
+ * 4. The decoder goes forwards and undoes it: slot x - L gives the symbol and
+ *    n = f + which occurrence of s the slot is, so n << nb ∈ [L, 2L) gives nb,
+ *    and the state before is (n << nb) + the next nb bits.
+ *
+ *   L = 8, a: 5 b: 3    slots  a b a a b a a b     b in state 12 (slot 4)
+ *                                                  → n = 4, nb = 1, x = 8 | 9
+ *
+ * The decoder reads what the encoder wrote last first, so the bitstream is
+ * read backwards, see TansReader. The payload of a BLOCK_TANS block is
+ *
+ *   table log (u8) | bitmap of the appeared symbols (32 bytes) |
+ *   frequency - 1 of every appeared symbol (LEB128) | bitstream
+ */
+typedef struct {
+    uint32_t threshold;
+    // f << bits, a state below it writes bits - 1 bits instead of bits
+    int bits;
+    int offset;
+    // states[offset + (x >> nb)] is the next state, offset = start of s - f
+} TansSymbol;
+
+typedef struct {
+    TansSymbol symbols[ASCII];
+    uint16_t states[1 << TANS_TABLE_LOG];
+    uint32_t frequencies[ASCII];
+    int table_log;
+} TansEncoder;
+
+typedef struct {
+    uint16_t base;
+    unsigned char symbol;
+    unsigned char bits;
+} TansEntry;
+// The state after this slot is base + the next `bits` bits, always < L
+
+typedef struct {
+    TansEntry table[1 << TANS_TABLE_LOG];
+    int table_log;
+} TansDecoder;
+
+static inline int floor_log2(uint32_t x) {
+    return 31 - __builtin_clz(x);
+}
+
+/**
+ * tans_table_log function picks the smallest table that still gives the
+ * frequencies some precision, a table larger than the block only costs time.
+ */
+static int tans_table_log(const SymbolStats* stats) {
+    int table_log = TANS_MIN_TABLE_LOG;
+    while (table_log < TANS_TABLE_LOG &&
+           ((1ull << table_log) < stats->length || (1 << table_log) < 2 * stats->count)) {
+        table_log++;
+    }
+    return table_log;
+}
+
+/**
+ * tans_normalize function rounds the appear times to frequencies adding up to
+ * 2^table_log, every appeared symbol gets at least 1. The difference left by
+ * rounding is fixed one unit at a time where it costs the least: f + 1 saves
+ * about c · log₂((f + 1) / f) ≈ c / (f + 0.5) bits for a symbol of c appear
+ * times, f - 1 costs about c / (f - 0.5).
+ */
+static void tans_normalize(const SymbolStats* stats, int table_log, uint32_t frequencies[]) {
+    uint32_t total = 1u << table_log;
+    uint32_t sum = 0;
+    memset(frequencies, 0, ASCII * sizeof(uint32_t));
+    for (int i = 0; i < stats->count; ++i) {
+        int s = stats->kind[i];
+        uint64_t scaled = (stats->appear_times[s] * total + stats->length / 2) / stats->length;
+        frequencies[s] = scaled ? (uint32_t)scaled : 1;
+        sum += frequencies[s];
+    }
+    while (sum != total) {
+        int grow = sum < total;
+        int best = -1;
+        double best_gain = 0.0;
+        for (int i = 0; i < stats->count; ++i) {
+            int s = stats->kind[i];
+            double c = (double)stats->appear_times[s];
+            if (!grow && frequencies[s] == 1) continue;
+            double gain = grow ? c / (frequencies[s] + 0.5) : -c / (frequencies[s] - 0.5);
+            if (best < 0 || gain > best_gain) {
+                best = s;
+                best_gain = gain;
+            }
+        }
+        frequencies[best] += grow ? 1 : -1;
+        sum += grow ? 1 : -1;
+        // sum > total ≥ count means some frequency is > 1, so best is found
+    }
+}
+
+/**
+ * tans_spread function is the spread of FSE: step is odd (L ≥ 32), so going
+ * by step mod L visits every slot once.
+ */
+static void tans_spread(const uint32_t frequencies[], int table_log, unsigned char spread[]) {
+    uint32_t size = 1u << table_log, mask = size - 1;
+    uint32_t step = (size >> 1) + (size >> 3) + 3;
+    uint32_t position = 0;
+    for (int s = 0; s < ASCII; ++s) {
+        for (uint32_t j = 0; j < frequencies[s]; ++j) {
+            spread[position] = (unsigned char)s;
+            position = (position + step) & mask;
+        }
+    }
+}
+
+static void tans_encoder_init(TansEncoder* encoder, int table_log) {
+    unsigned char spread[1 << TANS_TABLE_LOG];
+    uint32_t size = 1u << table_log;
+    uint32_t next[ASCII];
+    uint32_t start = 0;
+    tans_spread(encoder->frequencies, table_log, spread);
+    encoder->table_log = table_log;
+    for (int s = 0; s < ASCII; ++s) {
+        uint32_t f = encoder->frequencies[s];
+        if (f == 0) continue;
+        int bits = table_log - floor_log2(f);
+        encoder->symbols[s].threshold = f << bits;
+        encoder->symbols[s].bits = bits;
+        encoder->symbols[s].offset = (int)start - (int)f;
+        next[s] = start;
+        start += f;
+    }
+    for (uint32_t p = 0; p < size; ++p) {
+        encoder->states[next[spread[p]]++] = (uint16_t)(size + p);
+    }
+}
+
+static void tans_decoder_init(TansDecoder* decoder, const uint32_t frequencies[], int table_log) {
+    unsigned char spread[1 << TANS_TABLE_LOG];
+    uint32_t size = 1u << table_log;
+    uint32_t next[ASCII];
+    memcpy(next, frequencies, sizeof(next));
+    tans_spread(frequencies, table_log, spread);
+    decoder->table_log = table_log;
+    for (uint32_t p = 0; p < size; ++p) {
+        uint32_t n = next[spread[p]]++;
+        int bits = table_log - floor_log2(n);
+        decoder->table[p].base = (uint16_t)((n << bits) - size);
+        decoder->table[p].symbol = spread[p];
+        decoder->table[p].bits = (unsigned char)bits;
+    }
+}
+
+/**
+ * tans_write_table function stores table_log and the frequencies as in the
+ * payload layout above and returns the number of bytes written, at most
+ * TANS_HEADER_SIZE.
+ */
+static size_t tans_write_table(const uint32_t frequencies[], int table_log, unsigned char* out) {
+    size_t size = 1 + ASCII / 8;
+    out[0] = (unsigned char)table_log;
+    memset(out + 1, 0, ASCII / 8);
+    for (int s = 0; s < ASCII; ++s) {
+        if (frequencies[s] == 0) continue;
+        out[1 + s / 8] |= (unsigned char)(1 << (s % 8));
+        uint32_t value = frequencies[s] - 1;
+        if (value < 0x80) {
+            out[size++] = (unsigned char)value;
+        } else {
+            out[size++] = (unsigned char)(0x80 | (value & 0x7f));
+            out[size++] = (unsigned char)(value >> 7);
+        }
+    }
+    return size;
+}
+
+/**
+ * tans_read_table function is the inverse of tans_write_table, it returns the
+ * number of bytes read or -1 if the frequencies don't add up to 2^table_log.
+ */
+static long tans_read_table(const unsigned char* in, size_t size, uint32_t frequencies[], int* table_log) {
+    if (size < 1 + ASCII / 8) return -1;
+    *table_log = in[0];
+    if (*table_log < TANS_MIN_TABLE_LOG || *table_log > TANS_TABLE_LOG) return -1;
+    uint32_t total = 1u << *table_log, sum = 0;
+    size_t pos = 1 + ASCII / 8;
+    for (int s = 0; s < ASCII; ++s) {
+        frequencies[s] = 0;
+        if (!(in[1 + s / 8] & (1 << (s % 8)))) continue;
+        if (pos >= size) return -1;
+        uint32_t value = in[pos++];
+        if (value & 0x80) {
+            if (pos >= size) return -1;
+            value = (value & 0x7f) | ((uint32_t)in[pos++] << 7);
+        }
+        if (value >= total) return -1;
+        frequencies[s] = value + 1;
+        sum += value + 1;
+    }
+    return sum == total ? (long)pos : -1;
+}
+
+/**
+ * TansWriter is a bit writer the other way around from BitWriter: new bits go
+ * above the pending ones and the bytes are stored in little endian order, so
+ * bit i of the stream is bit (i mod 8) of byte i / 8. After the last bit a 1
+ * bit is added, the highest set bit of the last byte tells the reader where
+ * the stream ends.
+ *
+ * tans_writer_put doesn't store anything, tans_writer_flush is called after
+ * every 4 symbols (at most 4 · TANS_TABLE_LOG + 7 < 64 bits are pending). It
+ * always stores 8 bytes, so out needs 8 bytes of room after the stream.
+ */
+typedef struct {
+    unsigned char* out;
+    size_t pos;
+    uint64_t acc;
+    int count;
+} TansWriter;
+
+static inline void store_le64_unaligned(unsigned char* p, uint64_t x) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    memcpy(p, &x, 8);
+}
+
+static inline void tans_writer_put(TansWriter* writer, uint32_t bits, int length) {
+    writer->acc |= (uint64_t)bits << writer->count;
+    writer->count += length;
+}
+
+static inline void tans_writer_flush(TansWriter* writer) {
+    store_le64_unaligned(writer->out + writer->pos, writer->acc);
+    writer->pos += writer->count >> 3;
+    writer->acc >>= writer->count & ~7;
+    writer->count &= 7;
+}
+
+static void tans_writer_finish(TansWriter* writer) {
+    tans_writer_put(writer, 1, 1);
+    tans_writer_flush(writer);
+    if (writer->count > 0) writer->out[writer->pos++] = (unsigned char)writer->acc;
+}
+
+/**
+ * tans_encode function codes data backwards with two states, the even
+ * symbols move state 0 and the odd ones state 1. They share the bitstream but
+ * not the chain of table lookups, so the decoder can work on both at once.
+ * Both begin at L, and the states they end with are written last so they are
+ * the first thing the decoder reads.
+ *
+ * tans_encode_run is the loop on one piece: states[0] is the state of its
+ * first symbol. A block in pieces is coded from the last piece to the first,
+ * and the states are swapped around a piece that starts at an odd offset.
+ */
+static void tans_encode_run(const TansEncoder* encoder, const unsigned char* data, size_t length, uint32_t states[2],
+                            TansWriter* out) {
+    TansWriter writer = *out;
+    uint32_t x[2] = { states[0], states[1] };
+#define ENCODE_ONE(i)                                                         \
+    do {                                                                      \
+        const TansSymbol* symbol = &encoder->symbols[data[i]];                \
+        uint32_t* state = &x[(i) & 1];                                        \
+        int bits = symbol->bits - (*state < symbol->threshold);               \
+        tans_writer_put(&writer, *state & ((1u << bits) - 1), bits);          \
+        *state = encoder->states[symbol->offset + (int)(*state >> bits)];     \
+    } while (0)
+    size_t i = length;
+    for (; i % 4 != 0; ) {
+        --i;
+        ENCODE_ONE(i);
+    }
+    tans_writer_flush(&writer);
+    while (i > 0) {
+        ENCODE_ONE(i - 1);
+        ENCODE_ONE(i - 2);
+        ENCODE_ONE(i - 3);
+        ENCODE_ONE(i - 4);
+        tans_writer_flush(&writer);
+        i -= 4;
+    }
+#undef ENCODE_ONE
+    states[0] = x[0];
+    states[1] = x[1];
+    *out = writer;
+}
+
+static size_t tans_encode(const TansEncoder* encoder, const struct iovec* vectors, int count, size_t length,
+                          unsigned char* out) {
+    TansWriter writer = { out, 0, 0, 0 };
+    uint32_t size = 1u << encoder->table_log;
+    uint32_t x[2] = { size, size };
+    size_t end = length;
+    for (int v = count - 1; v >= 0; --v) {
+        size_t start = end - vectors[v].iov_len;
+        uint32_t swapped[2] = { x[1], x[0] };
+        tans_encode_run(encoder, (const unsigned char*)vectors[v].iov_base, vectors[v].iov_len,
+                        start & 1 ? swapped : x, &writer);
+        if (start & 1) {
+            x[0] = swapped[1];
+            x[1] = swapped[0];
+        }
+        end = start;
+    }
+    tans_writer_put(&writer, x[0] - size, encoder->table_log);
+    tans_writer_put(&writer, x[1] - size, encoder->table_log);
+    tans_writer_finish(&writer);
+    return writer.pos;
+}
+
+/**
+ * TansReader reads a TansWriter stream from its end: container holds the 8
+ * bytes at p and the `consumed` highest bits of it are already read.
+ * tans_reader_reload moves p back by the whole bytes consumed, which is a load
+ * every few symbols instead of one per symbol. A stream shorter than 8 bytes
+ * is copied to the end of 8 bytes of 0, the bits before it (padding) are
+ * never read.
+ */
+typedef struct {
+    const unsigned char* start;
+    const unsigned char* p;
+    uint64_t container;
+    unsigned consumed;
+    unsigned padding;
+    unsigned char copy[8];
+} TansReader;
+
+static inline uint64_t load_le64_unaligned(const unsigned char* p) {
+    uint64_t x;
+    memcpy(&x, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    return x;
+}
+
+static int tans_reader_init(TansReader* reader, const unsigned char* in, size_t size) {
+    if (size == 0 || in[size - 1] == 0) return -1;
+    reader->padding = 0;
+    if (size < 8) {
+        memset(reader->copy, 0, 8);
+        memcpy(reader->copy + 8 - size, in, size);
+        reader->padding = 8 * (8 - (unsigned)size);
+        in = reader->copy;
+        size = 8;
+    }
+    reader->start = in;
+    reader->p = in + size - 8;
+    reader->container = load_le64_unaligned(reader->p);
+    reader->consumed = 8 - floor_log2(in[size - 1]);
+    // The marker and the 0 bits above it
+    return 0;
+}
+
+static inline void tans_reader_reload(TansReader* reader) {
+    size_t back = reader->consumed >> 3;
+    if ((size_t)(reader->p - reader->start) < back) back = reader->p - reader->start;
+    reader->p -= back;
+    reader->consumed -= 8 * (unsigned)back;
+    reader->container = load_le64_unaligned(reader->p);
+}
+
+/**
+ * tans_read function returns the next length bits, length is 0 to
+ * TANS_TABLE_LOG. Once a broken stream is read past its beginning (consumed
+ * > 64), the bits are garbage but the shift stays defined, and tans_decode
+ * notices at the end.
+ */
+static inline uint32_t tans_read(TansReader* reader, int length) {
+    uint32_t bits = (uint32_t)(((reader->container << (reader->consumed & 63)) >> 1) >> (63 - length));
+    reader->consumed += length;
+    return bits;
+}
+
+/**
+ * tans_decode function decodes length symbols, it returns -1 unless exactly
+ * the whole stream is read and both states are back to L, where the encoder
+ * began. A state is always < L after a step (n << nb ∈ [L, 2L) and its low
+ * nb bits are 0), so even a broken stream never reads outside of the table.
+ */
+/**
+ * tans_decode_run function decodes length symbols to out, states[0] is the
+ * state of the first one. Like tans_encode_run a piece at an odd offset of the
+ * block gets the states swapped.
+ */
+static void tans_decode_run(const TansDecoder* decoder, TansReader* reader, uint32_t states[2], unsigned char* out,
+                            size_t length) {
+    const TansEntry* table = decoder->table;
+    uint32_t x0 = states[0], x1 = states[1];
+#define DECODE_ONE(state, i)                                  \
+    do {                                                      \
+        TansEntry entry = table[state];                       \
+        out[i] = entry.symbol;                                \
+        state = entry.base + tans_read(reader, entry.bits);   \
+    } while (0)
+    size_t i = 0;
+    for (; i + 4 <= length; i += 4) {
+        tans_reader_reload(reader);
+        DECODE_ONE(x0, i);
+        DECODE_ONE(x1, i + 1);
+        DECODE_ONE(x0, i + 2);
+        DECODE_ONE(x1, i + 3);
+    }
+    tans_reader_reload(reader);
+    for (; i < length; ++i) {
+        if (i & 1) {
+            DECODE_ONE(x1, i);
+        } else {
+            DECODE_ONE(x0, i);
+        }
+    }
+#undef DECODE_ONE
+    states[0] = x0;
+    states[1] = x1;
+}
+
+static int tans_decode(const TansDecoder* decoder, TansReader* reader, const struct iovec* vectors, size_t length) {
+    uint32_t x[2];
+    x[1] = tans_read(reader, decoder->table_log);
+    x[0] = tans_read(reader, decoder->table_log);
+    SegmentCursor cursor;
+    segment_seek(&cursor, vectors, 0);
+    for (size_t from = 0; from < length;) {
+        unsigned char* piece;
+        size_t piece_length = segment_next(&cursor, length - from, &piece);
+        uint32_t swapped[2] = { x[1], x[0] };
+        tans_decode_run(decoder, reader, from & 1 ? swapped : x, piece, piece_length);
+        if (from & 1) {
+            x[0] = swapped[1];
+            x[1] = swapped[0];
+        }
+        from += piece_length;
+    }
+    uint32_t x0 = x[0], x1 = x[1];
+    tans_reader_reload(reader);
+    int64_t rest = 8 * (int64_t)(reader->p - reader->start) + 64 - (int64_t)reader->consumed;
+    return rest == reader->padding && x0 == 0 && x1 == 0 ? 0 : -1;
+}
+
+/**
+ * adler32 function is the checksum of zlib: a is 1 + the sum of all bytes and
+ * b is the sum of every a, both mod 65521. The modulo only has to be taken
+ * every ADLER_NMAX bytes, the largest n for which b can't overflow 32 bits.
+ */
+uint32_t adler32(uint32_t adler, const unsigned char* data, size_t length) {
+    uint32_t a = adler & 0xffff;
+    uint32_t b = adler >> 16;
+    while (length > 0) {
+        size_t n = length < ADLER_NMAX ? length : ADLER_NMAX;
+        length -= n;
+        for (size_t i = 0; i < n; ++i) {
+            a += data[i];
+            b += a;
+        }
+        data += n;
+        a %= ADLER_MOD;
+        b %= ADLER_MOD;
+    }
+    return (b << 16) | a;
+}
+
+static void write_block_header(const BlockHeader* header, unsigned char* out) {
+    out[0] = (unsigned char)header->mode;
+    out[1] = (unsigned char)header->flags;
+    out[2] = (unsigned char)header->table;
+    out[3] = 0;
+    store_le32(out + 4, header->raw_length);
+    store_le32(out + 8, header->payload_length);
+    store_le32(out + 12, header->checksum);
+}
+
+void block_header_read(const unsigned char* in, BlockHeader* header) {
+    header->mode = in[0];
+    header->flags = in[1];
+    header->table = in[2];
+    header->raw_length = load_le32(in + 4);
+    header->payload_length = load_le32(in + 8);
+    header->checksum = load_le32(in + 12);
+}
+
+/**
+ * gather_vectors function copies the pieces one after another to out (that's
+ * the payload of a raw block, the one copy it can't do without), and
+ * scatter_vectors copies length bytes back over them. adler32_vectors is the
+ * checksum of the first length bytes of the pieces.
+ */
+static void gather_vectors(const struct iovec* vectors, int count, unsigned char* out) {
+    for (int v = 0; v < count; ++v) {
+        memcpy(out, vectors[v].iov_base, vectors[v].iov_len);
+        out += vectors[v].iov_len;
+    }
+}
+
+static void scatter_vectors(const unsigned char* in, size_t length, const struct iovec* vectors) {
+    SegmentCursor cursor;
+    segment_seek(&cursor, vectors, 0);
+    for (size_t from = 0; from < length;) {
+        unsigned char* piece;
+        size_t piece_length = segment_next(&cursor, length - from, &piece);
+        memcpy(piece, in + from, piece_length);
+        from += piece_length;
+    }
+}
+
+static uint32_t adler32_vectors(const struct iovec* vectors, size_t length) {
+    uint32_t adler = 1;
+    SegmentCursor cursor;
+    segment_seek(&cursor, vectors, 0);
+    for (size_t from = 0; from < length;) {
+        unsigned char* piece;
+        size_t piece_length = segment_next(&cursor, length - from, &piece);
+        adler = adler32(adler, piece, piece_length);
+        from += piece_length;
+    }
+    return adler;
+}
+
+/**
+ * huffman_stream_starts function splits length symbols to the parts of a
+ * BLOCK_HUFFMAN4 block, part k is from starts[k] to starts[k + 1].
+ */
+static void huffman_stream_starts(size_t length, size_t starts[]) {
+    size_t part = (length + HUFFMAN_STREAMS - 1) / HUFFMAN_STREAMS;
+    for (int k = 0; k <= HUFFMAN_STREAMS; ++k) {
+        starts[k] = (size_t)k * part < length ? (size_t)k * part : length;
+    }
+}
+
+/**
+ * With reuse_tables an encoder keeps the tables of its last TABLE_CACHE_SLOTS
+ * coded blocks, keyed by a signature of the histogram they were built for. A
+ * block whose histogram has the same signature as a cached table is coded
+ * with it: no tree, no normalization, and the block only says which slot to
+ * take (BLOCK_FLAG_REUSE). Otherwise the new table is sent as usual and
+ * replaces the least recently used slot (BLOCK_FLAG_STORE), the decoder keeps
+ * it in the same slot. Only the encoder runs the LRU, the decoder just does
+ * what the flags say.
+ *
+ * The signature quantizes every count to half octaves of its probability,
+ * 1 + ⌊2 · log₂(2¹⁶ · c / n)⌋, and the symbols below 1/32 (SIGNATURE_RARE)
+ * to 0: they come and go from block to block, and whatever code they get
+ * costs little. Two histograms that agree on that give nearly the same code
+ * lengths, a hit still checks that every symbol of the block has a code in
+ * the cached table.
+ */
+typedef enum {
+    TABLE_NONE,
+    TABLE_HUFFMAN,
+    TABLE_TANS,
+} TableKind;
+
+typedef struct {
+    uint64_t signature;
+    unsigned char quantized[ASCII];
+    HuffmanCode codes[ASCII];
+    TansEncoder tans;
+} EncoderTable;
+
+struct EntropyEncoder {
+    EntropyEncoderOptions options;
+    SymbolStats stats;
+    HuffmanCode codes[ASCII];
+    TansEncoder tans;
+    int kinds[TABLE_CACHE_SLOTS];
+    uint64_t used[TABLE_CACHE_SLOTS];
+    uint64_t tick;
+    EncoderTable tables[TABLE_CACHE_SLOTS];
+    int dictionary;
+    EncoderTable dictionary_table;
+    double dictionary_bits[2][ASCII];
+    // What every symbol costs with the Huffman and tANS tables of the
+    // dictionary, -1 for the symbols it has no code for
+};
+
+typedef union {
+    HuffmanDecoder huffman;
+    TansDecoder tans;
+} DecoderTable;
+
+struct EntropyDecoder {
+    int kinds[TABLE_CACHE_SLOTS + 1];
+    DecoderTable tables[TABLE_CACHE_SLOTS + 1];
+    // The last one is for the blocks without flags, which aren't kept
+    int dictionary;
+    DecoderTable dictionary_tables[2];
+    // Indexed by TableKind - 1
+};
+
+static uint64_t histogram_signature(const SymbolStats* stats, unsigned char quantized[]) {
+    uint64_t hash = 14695981039346656037ull;
+    for (int s = 0; s < ASCII; ++s) {
+        uint64_t scaled = (stats->appear_times[s] << 16) / stats->length;
+        int octave = floor_log2(scaled | 1);
+        int half = octave ? (int)(scaled >> (octave - 1)) & 1 : 0;
+        quantized[s] = scaled >= SIGNATURE_RARE ? (unsigned char)(1 + 2 * octave + half) : 0;
+        hash = (hash ^ quantized[s]) * 1099511628211ull;
+        // FNV-1a
+    }
+    return hash;
+}
+
+/**
+ * encoder_table_lookup function returns the slot of a cached table of kind
+ * with the same signature that has a code for every symbol of stats, or -1.
+ */
+static int encoder_table_lookup(const EntropyEncoder* encoder, int kind, const SymbolStats* stats,
+                                uint64_t signature, const unsigned char quantized[]) {
+    for (int slot = 0; slot < TABLE_CACHE_SLOTS; ++slot) {
+        const EncoderTable* table = &encoder->tables[slot];
+        if (encoder->kinds[slot] != kind || table->signature != signature ||
+            memcmp(table->quantized, quantized, ASCII) != 0) continue;
+        int covered = 1;
+        for (int s = 0; s < ASCII && covered; ++s) {
+            int coded = kind == TABLE_TANS ? table->tans.frequencies[s] > 0 : table->codes[s].length > 0;
+            covered = !stats->appear_times[s] || coded;
+        }
+        if (covered) return slot;
+    }
+    return -1;
+}
+
+/**
+ * encoder_table_victim function returns an empty slot, or the least recently
+ * used one.
+ */
+static int encoder_table_victim(const EntropyEncoder* encoder) {
+    int victim = 0;
+    for (int slot = 0; slot < TABLE_CACHE_SLOTS; ++slot) {
+        if (encoder->kinds[slot] == TABLE_NONE) return slot;
+        if (encoder->used[slot] < encoder->used[victim]) victim = slot;
+    }
+    return victim;
+}
+
+/**
+ * huffman_block_payload function writes the payload of a BLOCK_HUFFMAN or
+ * BLOCK_HUFFMAN4 block (by options->streams) and sets mode. Given codes
+ * (cached, or shared by a batch of the service) nothing is built, and the
+ * code lengths are only written with with_table. It returns the payload
+ * length or 0 if the codes can't be built.
+ */
+static size_t huffman_block_payload(EntropyEncoder* encoder, const struct iovec* vectors, size_t length,
+                                    unsigned char* payload, int* mode, const HuffmanCode* given, int with_table) {
+    const EntropyEncoderOptions* options = &encoder->options;
+    const HuffmanCode* codes = given;
+    if (!codes) {
+        if (build_huffman_codes(&encoder->stats, options->builder, options->max_bits, encoder->codes) < 0) return 0;
+        codes = encoder->codes;
+    }
+
+    STATS_BEGIN(start);
+    size_t payload_length = with_table ? write_code_lengths(codes, payload) : 0;
+    int max_length = 0;
+    for (int s = 0; s < ASCII; ++s) {
+        if (codes[s].length > max_length) max_length = codes[s].length;
+    }
+    HuffmanEncodeKernel encode = huffman_encode_kernel(max_length);
+    BitWriter writer;
+    *mode = options->streams == HUFFMAN_STREAMS ? BLOCK_HUFFMAN4 : BLOCK_HUFFMAN;
+    if (*mode == BLOCK_HUFFMAN) {
+        bit_writer_init(&writer, payload + payload_length);
+        huffman_encode_range(encode, vectors, 0, length, codes, &writer);
+        bit_writer_flush(&writer, 1);
+        payload_length += writer.pos;
+    } else {
+        unsigned char* jump_table = payload + payload_length;
+        payload_length += JUMP_TABLE_SIZE;
+        size_t starts[HUFFMAN_STREAMS + 1];
+        huffman_stream_starts(length, starts);
+        for (int k = 0; k < HUFFMAN_STREAMS; ++k) {
+            bit_writer_init(&writer, payload + payload_length);
+            huffman_encode_range(encode, vectors, starts[k], starts[k + 1], codes, &writer);
+            bit_writer_flush(&writer, 1);
+            payload_length += writer.pos;
+            if (k < HUFFMAN_STREAMS - 1) store_le32(jump_table + 4 * k, (uint32_t)writer.pos);
+        }
+    }
+    STATS_END(start, STATS_ENCODE, length);
+    return payload_length;
+}
+
+/**
+ * tans_block_payload function writes the payload of a BLOCK_TANS block and
+ * returns its length, as above a cached table is neither built nor written.
+ */
+static size_t tans_block_payload(EntropyEncoder* encoder, const struct iovec* vectors, int count, size_t length,
+                                 unsigned char* payload, const TansEncoder* cached) {
+    const TansEncoder* tans = cached;
+    if (!tans) {
+        STATS_BEGIN(build);
+        int table_log = tans_table_log(&encoder->stats);
+        tans_normalize(&encoder->stats, table_log, encoder->tans.frequencies);
+        tans_encoder_init(&encoder->tans, table_log);
+        STATS_END(build, STATS_BUILD, length);
+        tans = &encoder->tans;
+    }
+
+    STATS_BEGIN(start);
+    size_t payload_length = cached ? 0 : tans_write_table(tans->frequencies, tans->table_log, payload);
+    payload_length += tans_encode(tans, vectors, count, length, payload + payload_length);
+    STATS_END(start, STATS_ENCODE, length);
+    return payload_length;
+}
+
+/**
+ * rle_block_payload function writes the block as runs, every run is its symbol
+ * and then its length - 1 in LEB128. With out NULL it only returns the size.
+ * A run goes on across the pieces of vectors.
+ */
+static size_t rle_put_run(unsigned char symbol, uint64_t run, unsigned char* out, size_t size) {
+    if (out) out[size] = symbol;
+    size++;
+    uint64_t value = run - 1;
+    do {
+        if (out) out[size] = (unsigned char)((value & 0x7f) | (value > 0x7f ? 0x80 : 0));
+        size++;
+        value >>= 7;
+    } while (value);
+    return size;
+}
+
+static size_t rle_block_payload(const struct iovec* vectors, int count, unsigned char* out) {
+    size_t size = 0;
+    uint64_t run = 0;
+    unsigned char symbol = 0;
+    for (int v = 0; v < count; ++v) {
+        const unsigned char* data = (const unsigned char*)vectors[v].iov_base;
+        size_t length = vectors[v].iov_len;
+        for (size_t i = 0; i < length;) {
+            if (run > 0 && data[i] != symbol) {
+                size = rle_put_run(symbol, run, out, size);
+                run = 0;
+            }
+            symbol = data[i];
+            size_t start = i;
+            while (i < length && data[i] == symbol) i++;
+            run += i - start;
+        }
+    }
+    return run > 0 ? rle_put_run(symbol, run, out, size) : size;
+}
+
+/**
+ * auto_block_mode function picks the mode of a block for ENGINE_AUTO from the
+ * histogram alone, before any table is built or any bit is written:
+ *
+ * - BLOCK_RAW when the entropy (information_entropy_fast) is near 8 bits,
+ *   no code saves more than ~1% there, so the block is only copied,
+ * - BLOCK_RLE when one symbol is at least AUTO_RLE_DOMINANT of the block and
+ *   the runs are shorter than what the entropy promises (a block of a single
+ *   symbol is always one run),
+ * - otherwise Huffman, unless its redundancy can be large. Gallager's bound
+ *   says a Huffman code is at most p_max + 0.086 bits per symbol above the
+ *   entropy, when that's more than AUTO_HUFFMAN_SLACK of the entropy tANS
+ *   (which has almost no redundancy) is used.
+ */
+static int auto_block_mode(const SymbolStats* stats, const struct iovec* vectors, int count, int streams) {
+    double entropy = information_entropy_fast(stats->appear_times, stats->length);
+    if (entropy >= AUTO_RAW_ENTROPY) return BLOCK_RAW;
+
+    uint64_t most = 0;
+    for (int i = 0; i < stats->count; ++i) {
+        if (stats->appear_times[stats->kind[i]] > most) most = stats->appear_times[stats->kind[i]];
+    }
+    double p_max = (double)most / stats->length;
+    if (p_max >= AUTO_RLE_DOMINANT) {
+        double coded = entropy * stats->length / 8 + 1 + ASCII / 8 + stats->count;
+        // The bitstream and the table of a tANS block
+        if (rle_block_payload(vectors, count, NULL) <= coded) return BLOCK_RLE;
+    }
+    if (p_max + 0.086 > AUTO_HUFFMAN_SLACK * entropy) return BLOCK_TANS;
+    return streams == HUFFMAN_STREAMS ? BLOCK_HUFFMAN4 : BLOCK_HUFFMAN;
+}
+
+/**
+ * dictionary_table_kind function returns the dictionary table to code a block
+ * of kind with (ENGINE_AUTO may also take the other kind), or TABLE_NONE if
+ * none codes every symbol for fewer bits than the entropy plus a table of the
+ * block's own, estimated as in auto_block_mode.
+ */
+static int dictionary_table_kind(const EntropyEncoder* encoder, const SymbolStats* stats, int kind) {
+    double entropy = information_entropy_fast(stats->appear_times, stats->length);
+    double best_bits = entropy * stats->length + 8.0 * (1 + ASCII / 8 + stats->count);
+    int best = TABLE_NONE;
+    for (int k = TABLE_HUFFMAN; k <= TABLE_TANS; ++k) {
+        if (k != kind && encoder->options.engine != ENGINE_AUTO) continue;
+        double bits = k == TABLE_TANS ? 2.0 * encoder->dictionary_table.tans.table_log + 8 : 0.0;
+        // A tANS bitstream ends with both states and a marker byte
+        for (int i = 0; i < stats->count && bits >= 0; ++i) {
+            double cost = encoder->dictionary_bits[k - 1][stats->kind[i]];
+            bits = cost < 0 ? -1.0 : bits + cost * stats->appear_times[stats->kind[i]];
+        }
+        if (bits >= 0 && bits <= best_bits) {
+            best = k;
+            best_bits = bits;
+        }
+    }
+    return best;
+}
+
+/**
+ * encode_block function writes one whole block (header and payload) to out,
+ * which must have room for entropy_block_bound(length) bytes. It returns the
+ * size of the block or 0 if the codes can't be built.
+ *
+ * With ENGINE_AUTO a block is never larger than BLOCK_HEADER_SIZE + length:
+ * if the coded payload doesn't come out smaller than the data after all, the
+ * block is stored raw instead.
+ */
+static size_t encode_block(EntropyEncoder* encoder, const struct iovec* vectors, int count, size_t length,
+                           unsigned char* out) {
+    SymbolStats* stats = &encoder->stats;
+    symbol_stats_init(stats);
+    for (int v = 0; v < count; ++v) {
+        symbol_stats_update(stats, (const unsigned char*)vectors[v].iov_base, vectors[v].iov_len);
+    }
+    symbol_stats_finish(stats);
+
+    unsigned char* payload = out + BLOCK_HEADER_SIZE;
+    int engine = encoder->options.engine;
+    int mode = engine == ENGINE_AUTO ? auto_block_mode(stats, vectors, count, encoder->options.streams)
+               : engine == ENGINE_TANS ? BLOCK_TANS : BLOCK_HUFFMAN;
+    int kind = mode == BLOCK_TANS ? TABLE_TANS : mode == BLOCK_RAW || mode == BLOCK_RLE ? TABLE_NONE : TABLE_HUFFMAN;
+    EncoderTable* cached = NULL;
+    int flags = 0;
+    if (kind != TABLE_NONE && encoder->dictionary) {
+        int chosen = dictionary_table_kind(encoder, stats, kind);
+        if (chosen != TABLE_NONE) {
+            kind = chosen;
+            mode = kind == TABLE_TANS ? BLOCK_TANS : BLOCK_HUFFMAN;
+            cached = &encoder->dictionary_table;
+            flags = BLOCK_FLAG_DICTIONARY;
+        }
+    }
+    int slot = -1;
+    uint64_t signature = 0;
+    unsigned char quantized[ASCII];
+    if (kind != TABLE_NONE && !flags && encoder->options.reuse_tables) {
+        signature = histogram_signature(stats, quantized);
+        slot = encoder_table_lookup(encoder, kind, stats, signature, quantized);
+        if (slot >= 0) cached = &encoder->tables[slot];
+    }
+
+    size_t payload_length = length;
+    if (mode == BLOCK_RLE) {
+        payload_length = rle_block_payload(vectors, count, payload);
+    } else if (mode == BLOCK_TANS) {
+        payload_length = tans_block_payload(encoder, vectors, count, length, payload, cached ? &cached->tans : NULL);
+    } else if (mode != BLOCK_RAW) {
+        payload_length = huffman_block_payload(encoder, vectors, length, payload, &mode, cached ? cached->codes : NULL,
+                                               !cached);
+        if (payload_length == 0 && engine != ENGINE_AUTO) return 0;
+        // With ENGINE_AUTO codes that don't fit in max_bits are stored raw
+    }
+    if (mode == BLOCK_RAW || (engine == ENGINE_AUTO && (payload_length == 0 || payload_length >= length))) {
+        mode = BLOCK_RAW;
+        gather_vectors(vectors, count, payload);
+        payload_length = length;
+    }
+
+    BlockHeader header = { mode, 0, 0, (uint32_t)length, (uint32_t)payload_length, adler32_vectors(vectors, length) };
+    if (flags && mode != BLOCK_RAW) {
+        header.flags = flags;
+    } else if (kind != TABLE_NONE && !flags && mode != BLOCK_RAW && encoder->options.reuse_tables) {
+        STATS_ONLY(entropy_stats_tables(slot >= 0));
+        if (slot >= 0) {
+            header.flags = BLOCK_FLAG_REUSE;
+        } else {
+            slot = encoder_table_victim(encoder);
+            EncoderTable* table = &encoder->tables[slot];
+            table->signature = signature;
+            memcpy(table->quantized, quantized, ASCII);
+            if (kind == TABLE_HUFFMAN) {
+                memcpy(table->codes, encoder->codes, sizeof(table->codes));
+            } else {
+                table->tans = encoder->tans;
+            }
+            encoder->kinds[slot] = kind;
+            header.flags = BLOCK_FLAG_STORE;
+        }
+        header.table = slot;
+        encoder->used[slot] = ++encoder->tick;
+        // The cache only changes once the block is sure to carry the table
+    }
+    write_block_header(&header, out);
+    return BLOCK_HEADER_SIZE + header.payload_length;
+}
+
+static int decode_rle_block(const BlockHeader* header, const unsigned char* payload, const struct iovec* vectors) {
+    size_t pos = 0, filled = 0;
+    SegmentCursor cursor;
+    segment_seek(&cursor, vectors, 0);
+    while (pos < header->payload_length) {
+        unsigned char symbol = payload[pos++];
+        uint64_t run = 0;
+        int shift = 0;
+        unsigned char byte;
+        do {
+            if (pos >= header->payload_length || shift > 28) return -1;
+            byte = payload[pos++];
+            run |= (uint64_t)(byte & 0x7f) << shift;
+            shift += 7;
+        } while (byte & 0x80);
+        if (run >= header->raw_length - filled) return -1;
+        // The run goes past the end of the block
+        for (size_t left = run + 1; left > 0;) {
+            unsigned char* piece;
+            size_t length = segment_next(&cursor, left, &piece);
+            memset(piece, symbol, length);
+            left -= length;
+        }
+        filled += run + 1;
+    }
+    return filled == header->raw_length ? 0 : -1;
+}
+
+/**
+ * decode_table function sets up the decoder table of a Huffman or tANS block
+ * and returns it, table_size is how much of the payload the table took (0
+ * for BLOCK_FLAG_REUSE and BLOCK_FLAG_DICTIONARY). It returns NULL if the table is broken or the slot
+ * doesn't hold a table of that kind.
+ */
+static DecoderTable* decode_table(const BlockHeader* header, const unsigned char* payload, EntropyDecoder* context,
+                                  long* table_size) {
+    int kind = header->mode == BLOCK_TANS ? TABLE_TANS : TABLE_HUFFMAN;
+    int slot = TABLE_CACHE_SLOTS;
+    if (header->flags == BLOCK_FLAG_DICTIONARY) {
+        *table_size = 0;
+        return context->dictionary ? &context->dictionary_tables[kind - 1] : NULL;
+    }
+    if (header->flags & ~(BLOCK_FLAG_STORE | BLOCK_FLAG_REUSE)) return NULL;
+    if (header->flags) {
+        if (header->table >= TABLE_CACHE_SLOTS) return NULL;
+        slot = header->table;
+    }
+    DecoderTable* table = &context->tables[slot];
+    *table_size = 0;
+    if (header->flags & BLOCK_FLAG_REUSE) return context->kinds[slot] == kind ? table : NULL;
+
+    context->kinds[slot] = TABLE_NONE;
+    if (kind == TABLE_TANS) {
+        uint32_t frequencies[ASCII];
+        int table_log;
+        *table_size = tans_read_table(payload, header->payload_length, frequencies, &table_log);
+        if (*table_size < 0) return NULL;
+        tans_decoder_init(&table->tans, frequencies, table_log);
+    } else {
+        HuffmanCode codes[ASCII];
+        *table_size = read_code_lengths(payload, header->payload_length, codes);
+        if (*table_size < 0 || canonical_codes(codes) < 0) return NULL;
+        if (huffman_decoder_init(&table->huffman, codes) < 0) return NULL;
+    }
+    context->kinds[slot] = kind;
+    return table;
+}
+
+/**
+ * decode_block function decodes the payload of a block to the count pieces of
+ * vectors (which have room for raw_length bytes together) and verifies its
+ * checksum. It returns -1 if the block is corrupted.
+ */
+static int decode_block(const BlockHeader* header, const unsigned char* payload, const struct iovec* vectors,
+                        int count, EntropyDecoder* context) {
+    if (header->mode == BLOCK_TANS || header->mode == BLOCK_RAW || header->mode == BLOCK_RLE) {
+        if (header->mode != BLOCK_TANS && header->flags) return -1;
+        if (header->mode == BLOCK_RAW) {
+            if (header->payload_length != header->raw_length) return -1;
+            scatter_vectors(payload, header->raw_length, vectors);
+        } else if (header->mode == BLOCK_RLE) {
+            if (decode_rle_block(header, payload, vectors) < 0) return -1;
+        } else {
+            long table_size;
+            DecoderTable* table = decode_table(header, payload, context, &table_size);
+            TansReader reader;
+            if (!table || tans_reader_init(&reader, payload + table_size, header->payload_length - table_size) < 0 ||
+                tans_decode(&table->tans, &reader, vectors, header->raw_length) < 0) return -1;
+        }
+        return adler32_vectors(vectors, header->raw_length) == header->checksum ? 0 : -1;
+    }
+    if (header->mode != BLOCK_HUFFMAN && header->mode != BLOCK_HUFFMAN4) return -1;
+
+    long table_size;
+    DecoderTable* table = decode_table(header, payload, context, &table_size);
+    if (!table) return -1;
+    HuffmanDecoder* decoder = &table->huffman;
+
+    const unsigned char* p = payload + table_size;
+    const unsigned char* end = payload + header->payload_length;
+    if (header->mode == BLOCK_HUFFMAN) {
+        BitReader reader;
+        bit_reader_init(&reader, p, end);
+        if (huffman_decode_range(decoder, &reader, vectors, 0, header->raw_length) < 0) return -1;
+    } else {
+        if (end - p < JUMP_TABLE_SIZE) return -1;
+        const unsigned char* jump_table = p;
+        p += JUMP_TABLE_SIZE;
+        BitReader readers[HUFFMAN_STREAMS];
+        for (int k = 0; k < HUFFMAN_STREAMS; ++k) {
+            size_t size = k < HUFFMAN_STREAMS - 1 ? load_le32(jump_table + 4 * k) : (size_t)(end - p);
+            if (size > (size_t)(end - p)) return -1;
+            bit_reader_init(&readers[k], p, p + size);
+            p += size;
+        }
+        size_t starts[HUFFMAN_STREAMS + 1];
+        huffman_stream_starts(header->raw_length, starts);
+        if (count == 1) {
+            if (huffman_decode4_any(decoder, readers, (unsigned char*)vectors->iov_base, starts) < 0) return -1;
+        } else {
+            for (int k = 0; k < HUFFMAN_STREAMS; ++k) {
+                if (huffman_decode_range(decoder, &readers[k], vectors, starts[k], starts[k + 1]) < 0) return -1;
+            }
+            // The parts may cross pieces, so they're decoded one after another
+        }
+    }
+    if (adler32_vectors(vectors, header->raw_length) != header->checksum) return -1;
+    return 0;
+}
+
+const char* entropy_status_string(EntropyStatus status) {
+    switch (status) {
+    case ENTROPY_OK:
+        return "ok";
+    case ENTROPY_ERROR_ARGUMENT:
+        return "invalid argument";
+    case ENTROPY_ERROR_OUTPUT_SIZE:
+        return "output buffer too small";
+    case ENTROPY_ERROR_CORRUPTED:
+        return "corrupted block";
+    case ENTROPY_ERROR_MEMORY:
+        return "out of memory";
+    }
+    return "unknown status";
+}
+
+size_t entropy_block_bound(size_t length) {
+    size_t table_size = MAX_LENGTHS_SIZE + JUMP_TABLE_SIZE > TANS_HEADER_SIZE ? MAX_LENGTHS_SIZE + JUMP_TABLE_SIZE
+                                                                              : TANS_HEADER_SIZE;
+    return BLOCK_HEADER_SIZE + table_size + length * MAX_CODE_LENGTH / 8 + 16;
+    // A tANS symbol takes at most TANS_TABLE_LOG bits, far below a code
+}
+
+EntropyEncoder* entropy_encoder_create(const EntropyEncoderOptions* options) {
+    if (options->max_bits < 0 || options->max_bits > MAX_CODE_LENGTH) return NULL;
+    if (options->streams != 1 && options->streams != HUFFMAN_STREAMS) return NULL;
+    if (options->builder != BUILDER_HEAP && options->builder != BUILDER_INPLACE) return NULL;
+    if (options->engine != ENGINE_HUFFMAN && options->engine != ENGINE_TANS && options->engine != ENGINE_AUTO)
+        return NULL;
+    EntropyEncoder* encoder = (EntropyEncoder*)malloc(sizeof(EntropyEncoder));
+    if (encoder) {
+        encoder->options = *options;
+        encoder->dictionary = 0;
+        entropy_encoder_reset(encoder);
+    }
+    return encoder;
+}
+
+void entropy_encoder_reset(EntropyEncoder* encoder) {
+    for (int slot = 0; slot < TABLE_CACHE_SLOTS; ++slot) {
+        encoder->kinds[slot] = TABLE_NONE;
+        encoder->used[slot] = 0;
+    }
+    encoder->tick = 0;
+}
+
+void entropy_encoder_destroy(EntropyEncoder* encoder) {
+    free(encoder);
+}
+
+EntropyStatus entropy_encode_block(EntropyEncoder* encoder, const uint8_t* src, size_t length,
+                                   uint8_t* dst, size_t capacity, size_t* written) {
+    struct iovec vector = { (void*)src, length };
+    return entropy_encode_block_vectors(encoder, &vector, 1, dst, capacity, written);
+}
+
+EntropyStatus entropy_encode_block_vectors(EntropyEncoder* encoder, const struct iovec* src, int count,
+                                           uint8_t* dst, size_t capacity, size_t* written) {
+    *written = 0;
+    size_t length = 0;
+    for (int v = 0; v < count; ++v) {
+        length += src[v].iov_len;
+    }
+    if (count < 1 || length == 0 || length > UINT32_MAX) return ENTROPY_ERROR_ARGUMENT;
+    if (capacity < entropy_block_bound(length)) return ENTROPY_ERROR_OUTPUT_SIZE;
+    // The bit writer doesn't check for the end of dst, the bound is enough
+    size_t size = encode_block(encoder, src, count, length, dst);
+    if (size == 0) return ENTROPY_ERROR_ARGUMENT;
+    *written = size;
+    return ENTROPY_OK;
+}
+
+EntropyDecoder* entropy_decoder_create(void) {
+    EntropyDecoder* decoder = (EntropyDecoder*)malloc(sizeof(EntropyDecoder));
+    if (decoder) {
+        decoder->dictionary = 0;
+        entropy_decoder_reset(decoder);
+    }
+    return decoder;
+}
+
+void entropy_decoder_reset(EntropyDecoder* decoder) {
+    for (int slot = 0; slot <= TABLE_CACHE_SLOTS; ++slot) {
+        decoder->kinds[slot] = TABLE_NONE;
+    }
+}
+
+void entropy_decoder_destroy(EntropyDecoder* decoder) {
+    free(decoder);
+}
+
+EntropyStatus entropy_decode_block(EntropyDecoder* decoder, const uint8_t* src, size_t length,
+                                   uint8_t* dst, size_t capacity, size_t* written) {
+    struct iovec vector = { dst, capacity };
+    return entropy_decode_block_vectors(decoder, src, length, &vector, 1, written);
+}
+
+EntropyStatus entropy_decode_block_vectors(EntropyDecoder* decoder, const uint8_t* src, size_t length,
+                                           const struct iovec* dst, int count, size_t* written) {
+    *written = 0;
+    size_t capacity = 0;
+    for (int v = 0; v < count; ++v) {
+        capacity += dst[v].iov_len;
+    }
+    if (length < BLOCK_HEADER_SIZE) return ENTROPY_ERROR_CORRUPTED;
+    BlockHeader header;
+    block_header_read(src, &header);
+    if (header.payload_length > length - BLOCK_HEADER_SIZE ||
+        header.payload_length > entropy_block_bound(header.raw_length)) return ENTROPY_ERROR_CORRUPTED;
+    if (capacity < header.raw_length) return ENTROPY_ERROR_OUTPUT_SIZE;
+    STATS_BEGIN(start);
+    if (decode_block(&header, src + BLOCK_HEADER_SIZE, dst, count, decoder) < 0) return ENTROPY_ERROR_CORRUPTED;
+    STATS_END(start, STATS_DECODE, header.raw_length);
+    *written = header.raw_length;
+    return ENTROPY_OK;
+}
+
+/**
+ * entropy_dictionary_train function builds both tables from the histogram of
+ * all the samples. The Huffman one counts every byte once more than it
+ * appeared, so the bytes that never did still get a code (of at most
+ * DICTIONARY_MAX_BITS bits) and every block can use it.
+ */
+EntropyStatus entropy_dictionary_train(const SymbolStats* samples, uint8_t dictionary[DICTIONARY_SIZE]) {
+    if (samples->length == 0) return ENTROPY_ERROR_ARGUMENT;
+    SymbolStats smoothed;
+    symbol_stats_init(&smoothed);
+    for (int s = 0; s < ASCII; ++s) {
+        smoothed.appear_times[s] = samples->appear_times[s] + 1;
+    }
+    smoothed.length = samples->length + ASCII;
+    symbol_stats_finish(&smoothed);
+    HuffmanCode codes[ASCII];
+    if (build_huffman_codes(&smoothed, BUILDER_HEAP, DICTIONARY_MAX_BITS, codes) < 0) return ENTROPY_ERROR_ARGUMENT;
+    uint32_t frequencies[ASCII];
+    tans_normalize(samples, TANS_TABLE_LOG, frequencies);
+
+    memcpy(dictionary, DICTIONARY_MAGIC, 4);
+    dictionary[4] = DICTIONARY_VERSION;
+    dictionary[5] = TANS_TABLE_LOG;
+    dictionary[6] = dictionary[7] = 0;
+    unsigned char* lengths = dictionary + DICTIONARY_HEADER_SIZE;
+    for (int s = 0; s < ASCII; ++s) {
+        lengths[s] = (unsigned char)codes[s].length;
+        lengths[ASCII + 2 * s] = (unsigned char)frequencies[s];
+        lengths[ASCII + 2 * s + 1] = (unsigned char)(frequencies[s] >> 8);
+    }
+    store_le32(dictionary + 8, adler32(1, lengths, DICTIONARY_SIZE - DICTIONARY_HEADER_SIZE));
+    return ENTROPY_OK;
+}
+
+uint32_t entropy_dictionary_id(const uint8_t* dictionary) {
+    return load_le32(dictionary + 8);
+}
+
+/**
+ * dictionary_tables function checks a dictionary and reads its tables, it
+ * returns -1 if it's not one of this version or it's damaged.
+ */
+static int dictionary_tables(const uint8_t* dictionary, size_t size, HuffmanCode codes[], uint32_t frequencies[],
+                             int* table_log) {
+    if (size != DICTIONARY_SIZE || memcmp(dictionary, DICTIONARY_MAGIC, 4) != 0 ||
+        dictionary[4] != DICTIONARY_VERSION) return -1;
+    const unsigned char* lengths = dictionary + DICTIONARY_HEADER_SIZE;
+    if (entropy_dictionary_id(dictionary) != adler32(1, lengths, DICTIONARY_SIZE - DICTIONARY_HEADER_SIZE)) return -1;
+    *table_log = dictionary[5];
+    if (*table_log < TANS_MIN_TABLE_LOG || *table_log > TANS_TABLE_LOG) return -1;
+    uint32_t sum = 0;
+    for (int s = 0; s < ASCII; ++s) {
+        codes[s].length = lengths[s];
+        frequencies[s] = lengths[ASCII + 2 * s] | (uint32_t)lengths[ASCII + 2 * s + 1] << 8;
+        sum += frequencies[s];
+    }
+    if (sum != 1u << *table_log) return -1;
+    return canonical_codes(codes) < 0 ? -1 : 0;
+}
+
+EntropyStatus entropy_encoder_load_dictionary(EntropyEncoder* encoder, const uint8_t* dictionary, size_t size) {
+    EncoderTable* table = &encoder->dictionary_table;
+    int table_log;
+    encoder->dictionary = 0;
+    if (dictionary_tables(dictionary, size, table->codes, table->tans.frequencies, &table_log) < 0) {
+        return ENTROPY_ERROR_CORRUPTED;
+    }
+    tans_encoder_init(&table->tans, table_log);
+    for (int s = 0; s < ASCII; ++s) {
+        uint32_t frequency = table->tans.frequencies[s];
+        int length = table->codes[s].length;
+        int max_bits = encoder->options.max_bits;
+        encoder->dictionary_bits[0][s] = length && (!max_bits || length <= max_bits) ? length : -1.0;
+        encoder->dictionary_bits[1][s] = frequency ? table_log - log2(frequency) : -1.0;
+    }
+    encoder->dictionary = 1;
+    return ENTROPY_OK;
+}
+
+EntropyStatus entropy_decoder_load_dictionary(EntropyDecoder* decoder, const uint8_t* dictionary, size_t size) {
+    HuffmanCode codes[ASCII];
+    uint32_t frequencies[ASCII];
+    int table_log;
+    decoder->dictionary = 0;
+    if (dictionary_tables(dictionary, size, codes, frequencies, &table_log) < 0 ||
+        huffman_decoder_init(&decoder->dictionary_tables[TABLE_HUFFMAN - 1].huffman, codes) < 0) {
+        return ENTROPY_ERROR_CORRUPTED;
+    }
+    tans_decoder_init(&decoder->dictionary_tables[TABLE_TANS - 1].tans, frequencies, table_log);
+    decoder->dictionary = 1;
+    return ENTROPY_OK;
+}
+
+/**
+ * encode_shared_block function is encode_block with the codes of a whole
+ * batch: they're written to the block like its own, only not built for it.
+ */
+static size_t encode_shared_block(EntropyEncoder* encoder, const HuffmanCode codes[], const unsigned char* data,
+                                  size_t length, unsigned char* out) {
+    unsigned char* payload = out + BLOCK_HEADER_SIZE;
+    struct iovec vector = { (void*)data, length };
+    int mode;
+    size_t payload_length = huffman_block_payload(encoder, &vector, length, payload, &mode, codes, 1);
+    if (encoder->options.engine == ENGINE_AUTO && payload_length >= length) {
+        mode = BLOCK_RAW;
+        memcpy(payload, data, length);
+        payload_length = length;
+    }
+    BlockHeader header = { mode, 0, 0, (uint32_t)length, (uint32_t)payload_length, adler32(1, data, length) };
+    write_block_header(&header, out);
+    return BLOCK_HEADER_SIZE + payload_length;
+}
+
+#define SERVICE_MAX_THREADS 256
+#define SERVICE_MAX_BATCH 4096
+
+typedef struct {
+    EntropyService* service;
+    pthread_t thread;
+    EntropyEncoder* encoder;
+    EntropyRequest** batch;
+    SymbolStats* stats;
+    // One of each per request of a batch
+} ServiceWorker;
+
+struct EntropyService {
+    EntropyServiceOptions options;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    // A request was submitted, or the service is stopping
+    pthread_cond_t completed;
+    // A request went to the completion queue
+    EntropyRequest* pending;
+    EntropyRequest** pending_tail;
+    EntropyRequest* done;
+    EntropyRequest** done_tail;
+    size_t awaiting;
+    // Requests without callback that entropy_service_poll hasn't taken yet
+    int stopping;
+    int started;
+    ServiceWorker* workers;
+};
+
+/**
+ * share_codes function tells if a request of stats is coded with the codes
+ * of its batch: when ENGINE_AUTO would code it with Huffman anyway and the
+ * shared codes (with their table) cost no more than the entropy plus a table
+ * of its own, estimated as in auto_block_mode.
+ */
+static int share_codes(const EntropyEncoderOptions* options, const SymbolStats* stats, const unsigned char* data,
+                       const HuffmanCode shared[], size_t table_size) {
+    if (options->engine == ENGINE_AUTO) {
+        struct iovec vector = { (void*)data, stats->length };
+        int mode = auto_block_mode(stats, &vector, 1, options->streams);
+        if (mode != BLOCK_HUFFMAN && mode != BLOCK_HUFFMAN4) return 0;
+    }
+    double entropy = information_entropy_fast(stats->appear_times, stats->length);
+    double own_bits = entropy * stats->length + 8.0 * (1 + ASCII / 8 + stats->count);
+    double bits = 8.0 * table_size;
+    for (int i = 0; i < stats->count; ++i) {
+        bits += (double)stats->appear_times[stats->kind[i]] * shared[stats->kind[i]].length;
+    }
+    return bits <= own_bits;
+}
+
+/**
+ * service_encode_batch function encodes count requests of worker->batch. The
+ * histograms are counted once and merged, the tree of the merged histogram
+ * is built once for the whole batch (it has a code for every symbol of every
+ * request), and only the requests that share_codes rejects go through
+ * entropy_encode_block alone. tANS and dictionaries share nothing: a tANS
+ * table is the expensive part to write, and a dictionary has no table at all.
+ */
+static void service_encode_batch(ServiceWorker* worker, int count) {
+    EntropyEncoder* encoder = worker->encoder;
+    const EntropyEncoderOptions* options = &encoder->options;
+    HuffmanCode shared[ASCII];
+    size_t table_size = 0;
+    int share = count > 1 && !encoder->dictionary && options->engine != ENGINE_TANS;
+    if (share) {
+        SymbolStats* merged = &encoder->stats;
+        symbol_stats_init(merged);
+        for (int i = 0; i < count; ++i) {
+            SymbolStats* stats = &worker->stats[i];
+            symbol_stats_init(stats);
+            symbol_stats_update(stats, worker->batch[i]->src, worker->batch[i]->length);
+            symbol_stats_finish(stats);
+            for (int s = 0; s < ASCII; ++s) {
+                merged->appear_times[s] += stats->appear_times[s];
+            }
+            merged->length += stats->length;
+        }
+        symbol_stats_finish(merged);
+        unsigned char lengths[MAX_LENGTHS_SIZE];
+        share = build_huffman_codes(merged, options->builder, options->max_bits, shared) == 0;
+        if (share) table_size = write_code_lengths(shared, lengths);
+    }
+
+    for (int i = 0; i < count; ++i) {
+        EntropyRequest* request = worker->batch[i];
+        if (share && share_codes(options, &worker->stats[i], request->src, shared, table_size)) {
+            request->written = encode_shared_block(encoder, shared, request->src, request->length, request->dst);
+            request->status = ENTROPY_OK;
+        } else {
+            request->status = entropy_encode_block(encoder, request->src, request->length, request->dst,
+                                                   request->capacity, &request->written);
+        }
+    }
+}
+
+/**
+ * service_complete function hands count finished requests back. A callback
+ * may free its request, so nothing touches a request after its callback.
+ */
+static void service_complete(EntropyService* service, EntropyRequest* batch[], int count) {
+    int queued = 0;
+    for (int i = 0; i < count; ++i) {
+        if (batch[i]->callback) {
+            batch[i]->callback(batch[i]);
+        } else {
+            batch[queued++] = batch[i];
+        }
+    }
+    if (queued == 0) return;
+    pthread_mutex_lock(&service->lock);
+    for (int i = 0; i < queued; ++i) {
+        batch[i]->next = NULL;
+        *service->done_tail = batch[i];
+        service->done_tail = &batch[i]->next;
+    }
+    pthread_cond_broadcast(&service->completed);
+    pthread_mutex_unlock(&service->lock);
+}
+
+static void* service_worker(void* arg) {
+    ServiceWorker* worker = (ServiceWorker*)arg;
+    EntropyService* service = worker->service;
+    for (;;) {
+        pthread_mutex_lock(&service->lock);
+        while (!service->pending && !service->stopping) pthread_cond_wait(&service->work, &service->lock);
+        int count = 0;
+        while (service->pending && count < service->options.batch) {
+            worker->batch[count++] = service->pending;
+            service->pending = service->pending->next;
+        }
+        if (!service->pending) service->pending_tail = &service->pending;
+        pthread_mutex_unlock(&service->lock);
+        if (count == 0) return NULL;
+        // Stopping, and every request was taken
+        service_encode_batch(worker, count);
+        service_complete(service, worker->batch, count);
+    }
+}
+
+static void service_free(EntropyService* service) {
+    for (int t = 0; t < service->options.threads; ++t) {
+        entropy_encoder_destroy(service->workers[t].encoder);
+        free(service->workers[t].batch);
+        free(service->workers[t].stats);
+    }
+    free(service->workers);
+    pthread_mutex_destroy(&service->lock);
+    pthread_cond_destroy(&service->work);
+    pthread_cond_destroy(&service->completed);
+    free(service);
+}
+
+EntropyService* entropy_service_create(const EntropyServiceOptions* options) {
+    if (options->threads < 1 || options->threads > SERVICE_MAX_THREADS || options->batch < 1 ||
+        options->batch > SERVICE_MAX_BATCH || options->encoder.reuse_tables) return NULL;
+    EntropyService* service = (EntropyService*)calloc(1, sizeof(EntropyService));
+    if (!service) return NULL;
+    service->options = *options;
+    pthread_mutex_init(&service->lock, NULL);
+    pthread_cond_init(&service->work, NULL);
+    pthread_cond_init(&service->completed, NULL);
+    service->pending_tail = &service->pending;
+    service->done_tail = &service->done;
+    service->workers = (ServiceWorker*)calloc(options->threads, sizeof(ServiceWorker));
+    if (!service->workers) {
+        service->options.threads = 0;
+        service_free(service);
+        return NULL;
+    }
+
+    for (int t = 0; t < options->threads; ++t) {
+        ServiceWorker* worker = &service->workers[t];
+        worker->service = service;
+        worker->encoder = entropy_encoder_create(&options->encoder);
+        worker->batch = (EntropyRequest**)malloc(options->batch * sizeof(EntropyRequest*));
+        worker->stats = (SymbolStats*)malloc(options->batch * sizeof(SymbolStats));
+        if (!worker->encoder || !worker->batch || !worker->stats ||
+            (options->dictionary &&
+             entropy_encoder_load_dictionary(worker->encoder, options->dictionary, options->dictionary_size))) {
+            service_free(service);
+            return NULL;
+        }
+    }
+    for (; service->started < options->threads; ++service->started) {
+        ServiceWorker* worker = &service->workers[service->started];
+        if (pthread_create(&worker->thread, NULL, service_worker, worker) != 0) {
+            entropy_service_destroy(service);
+            return NULL;
+        }
+    }
+    return service;
+}
+
+EntropyStatus entropy_service_submit(EntropyService* service, EntropyRequest* request) {
+    if (request->length == 0 || request->length > UINT32_MAX) return ENTROPY_ERROR_ARGUMENT;
+    if (request->capacity < entropy_block_bound(request->length)) return ENTROPY_ERROR_OUTPUT_SIZE;
+    request->next = NULL;
+    request->written = 0;
+    pthread_mutex_lock(&service->lock);
+    if (service->stopping) {
+        pthread_mutex_unlock(&service->lock);
+        return ENTROPY_ERROR_ARGUMENT;
+    }
+    *service->pending_tail = request;
+    service->pending_tail = &request->next;
+    if (!request->callback) service->awaiting++;
+    pthread_cond_signal(&service->work);
+    pthread_mutex_unlock(&service->lock);
+    return ENTROPY_OK;
+}
+
+size_t entropy_service_poll(EntropyService* service, EntropyRequest* done[], size_t max, int wait) {
+    size_t count = 0;
+    pthread_mutex_lock(&service->lock);
+    while (wait && !service->done && service->awaiting > 0) {
+        pthread_cond_wait(&service->completed, &service->lock);
+    }
+    while (service->done && count < max) {
+        done[count++] = service->done;
+        service->done = service->done->next;
+        service->awaiting--;
+    }
+    if (!service->done) service->done_tail = &service->done;
+    pthread_mutex_unlock(&service->lock);
+    return count;
+}
+
+/**
+ * entropy_service_destroy function lets the workers finish everything that
+ * was submitted. The requests still in the completion queue are completed
+ * (written and status are set) but can't be polled any more.
+ */
+void entropy_service_destroy(EntropyService* service) {
+    pthread_mutex_lock(&service->lock);
+    service->stopping = 1;
+    pthread_cond_broadcast(&service->work);
+    pthread_mutex_unlock(&service->lock);
+    for (int t = 0; t < service->started; ++t) {
+        pthread_join(service->workers[t].thread, NULL);
+    }
+    service_free(service);
+}
+
+#ifdef ENTROPY_STATS
+static EntropyStats global_stats;
+
+static const char* stats_phase_names[STATS_PHASES] = { "histogram", "build", "codes", "encode", "decode", "output" };
+
+uint64_t entropy_stats_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * entropy_stats_record function adds one call of phase, which began at start
+ * (an entropy_stats_clock value) and ends now.
+ */
+void entropy_stats_record(StatsPhase phase, uint64_t start, uint64_t bytes) {
+    StatsCounter* counter = &global_stats.phases[phase];
+    __atomic_fetch_add(&counter->calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&counter->nanoseconds, entropy_stats_clock() - start, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&counter->bytes, bytes, __ATOMIC_RELAXED);
+}
+
+void entropy_stats_tables(int hit) {
+    __atomic_fetch_add(hit ? &global_stats.table_hits : &global_stats.table_misses, 1, __ATOMIC_RELAXED);
+}
+
+void entropy_stats_heap(uint64_t inserts, uint64_t extracts, uint64_t swaps) {
+    __atomic_fetch_add(&global_stats.heap_inserts, inserts, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&global_stats.heap_extracts, extracts, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&global_stats.heap_swaps, swaps, __ATOMIC_RELAXED);
+}
+
+/**
+ * entropy_stats_snapshot function copies the counters one by one, a phase
+ * that's recording at the same time may be half in the copy (calls already
+ * added, nanoseconds not yet), which is fine for a report.
+ */
+void entropy_stats_snapshot(EntropyStats* stats) {
+    uint64_t* from = (uint64_t*)&global_stats;
+    uint64_t* to = (uint64_t*)stats;
+    for (size_t i = 0; i < sizeof(EntropyStats) / sizeof(uint64_t); ++i) {
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    }
+}
+
+void entropy_stats_reset(void) {
+    uint64_t* counters = (uint64_t*)&global_stats;
+    for (size_t i = 0; i < sizeof(EntropyStats) / sizeof(uint64_t); ++i) {
+        __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * entropy_stats_dump_json function writes a snapshot of the counters as one
+ * JSON object, MB/s is bytes per wall second summed over the threads:
+ *
+ *   {"phases": {"histogram": {"calls": 8, "ns": 1052311, "bytes": 8388608,
+ *    "mb_per_s": 7971.6}, ...}, "heap": {"inserts": 510, ...}}
+ */
+void entropy_stats_dump_json(FILE* out) {
+    EntropyStats stats;
+    entropy_stats_snapshot(&stats);
+    fprintf(out, "{\"phases\": {");
+    for (int i = 0; i < STATS_PHASES; ++i) {
+        const StatsCounter* counter = &stats.phases[i];
+        double mb_per_s = counter->nanoseconds ? counter->bytes * 1e3 / counter->nanoseconds : 0.0;
+        fprintf(out, "%s\"%s\": {\"calls\": %llu, \"ns\": %llu, \"bytes\": %llu, \"mb_per_s\": %.1f}",
+                i ? ", " : "", stats_phase_names[i], (unsigned long long)counter->calls,
+                (unsigned long long)counter->nanoseconds, (unsigned long long)counter->bytes, mb_per_s);
+    }
+    fprintf(out, "}, \"heap\": {\"inserts\": %llu, \"extracts\": %llu, \"swaps\": %llu}",
+            (unsigned long long)stats.heap_inserts, (unsigned long long)stats.heap_extracts,
+            (unsigned long long)stats.heap_swaps);
+    fprintf(out, ", \"tables\": {\"hits\": %llu, \"misses\": %llu}}\n", (unsigned long long)stats.table_hits,
+            (unsigned long long)stats.table_misses);
+}
+#endif
\ No newline at end of file
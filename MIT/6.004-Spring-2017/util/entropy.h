@@ -0,0 +1,509 @@
+#ifndef ENTROPY_H
+#define ENTROPY_H
+
+/**
+ * entropy.h is the library part of 01-entropy.c: counting, entropy, Huffman
+ * code construction and the block format. 01-entropy.c is only the command
+ * line tool around it, with the files, threads and printing.
+ *
+ * Nothing here has global mutable state (but the -DENTROPY_STATS counters,
+ * see below). The few constant tables are built
+ * once with pthread_once, so different threads can use different contexts
+ * (or the plain functions) at the same time. One context must only be used by
+ * one thread at a time. After entropy_encoder_create / entropy_decoder_create
+ * no function allocates memory, every output buffer comes from the caller.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define ASCII 256
+#define MAX_CODE_LENGTH 63
+// A code is kept in the low `length` bits of an integer and the bit writer
+// puts at most 63 bits at once. A Huffman tree that deep needs more than
+// fib(63) ≈ 6.5 × 10¹² input bytes, so it doesn't happen in practice.
+
+#define MAX_LENGTHS_SIZE (2 * ASCII)
+// The code lengths of a block take at most one byte per symbol, see
+// write_code_lengths.
+
+#define BLOCK_HEADER_SIZE 16
+#define BLOCK_HUFFMAN 1
+#define BLOCK_HUFFMAN4 2
+#define BLOCK_TANS 3
+#define BLOCK_RAW 4
+#define BLOCK_RLE 5
+#define BLOCK_END 0xff
+// The mode byte of a block header
+#define BLOCK_FLAG_STORE 0x01
+#define BLOCK_FLAG_REUSE 0x02
+// The flags byte, see EntropyEncoderOptions.reuse_tables
+#define BLOCK_FLAG_DICTIONARY 0x04
+// The block is coded with the table of the loaded dictionary
+#define HUFFMAN_STREAMS 4
+
+typedef struct {
+    uint64_t bits;
+    int length;
+} HuffmanCode;
+// The code of a symbol is the lowest `length` bits of `bits`, the first bit of
+// the code is the highest one. So "110" is stored as { 0b110, 3 }.
+
+/**
+ * SymbolStats is the result of one counting pass. Entropy, total information
+ * and Huffman construction all read it, so the input is only walked once no
+ * matter how many of them are computed.
+ *
+ * kind[0..count) lists the appeared symbols in ascending order, it's filled by
+ * symbol_stats_finish after the last block has been counted.
+ */
+typedef struct {
+    uint64_t appear_times[ASCII];
+    uint64_t length;
+    int count;
+    unsigned char kind[ASCII];
+} SymbolStats;
+
+typedef enum {
+    BUILDER_HEAP,
+    BUILDER_INPLACE,
+} HuffmanBuilder;
+// BUILDER_HEAP is build_huffman with MinHeap, BUILDER_INPLACE is
+// huffman_lengths_inplace, both give optimal code lengths.
+
+typedef enum {
+    ENTROPY_OK = 0,
+    ENTROPY_ERROR_ARGUMENT = -1,
+    // An option out of range, or max_bits too small for the symbols
+    ENTROPY_ERROR_OUTPUT_SIZE = -2,
+    // The output buffer is smaller than entropy_block_bound / raw length
+    ENTROPY_ERROR_CORRUPTED = -3,
+    // The block doesn't decode or its checksum doesn't match
+    ENTROPY_ERROR_MEMORY = -4,
+} EntropyStatus;
+
+const char* entropy_status_string(EntropyStatus status);
+
+void symbol_stats_init(SymbolStats* stats);
+void symbol_stats_update(SymbolStats* stats, const unsigned char* data, size_t length);
+void symbol_stats_finish(SymbolStats* stats);
+
+/**
+ * histogram_count adds the byte counts of data to appear_times with the
+ * fastest kernel of this CPU, histogram_naive and histogram_scalar are there
+ * for the benchmarks.
+ */
+void histogram_count(const unsigned char* data, size_t length, uint64_t appear_times[]);
+void histogram_naive(const unsigned char* data, size_t length, uint64_t appear_times[]);
+void histogram_scalar(const unsigned char* data, size_t length, uint64_t appear_times[]);
+
+double information_entropy(const SymbolStats* stats);
+double information_value(const SymbolStats* stats);
+double information_entropy_fast(const uint64_t appear_times[], uint64_t length);
+double information_value_fast(const uint64_t appear_times[], uint64_t length);
+
+/**
+ * build_huffman_codes fills table with canonical Huffman codes for stats, no
+ * longer than max_bits when it's not 0. It returns -1 if that's impossible.
+ */
+int build_huffman_codes(const SymbolStats* stats, HuffmanBuilder builder, int max_bits, HuffmanCode table[]);
+int canonical_codes(HuffmanCode table[]);
+int max_code_length(const SymbolStats* stats, const HuffmanCode table[]);
+size_t write_code_lengths(const HuffmanCode table[], unsigned char* out);
+long read_code_lengths(const unsigned char* in, size_t size, HuffmanCode table[]);
+
+/**
+ * WideStats is SymbolStats for alphabets larger than the bytes: 16-bit
+ * tokens, event ids, hashed words. Alphabets up to WIDE_DENSE_ALPHABET are
+ * counted in an array like the bytes, larger ones in a hash table of the
+ * symbols that appeared, so the memory follows the distinct symbols and not
+ * the alphabet. The byte path above stays as it is, with its fixed 256.
+ *
+ * After wide_stats_finish kind[0..count) lists the appeared symbols in
+ * ascending order, and build_wide_codes gives their codes in the same order.
+ * Codes are at most WIDE_MAX_CODE_LENGTH bits, what a refill of BitReader
+ * always holds (it takes over 10¹¹ symbols to need longer ones).
+ */
+#define WIDE_DENSE_ALPHABET (1u << 16)
+#define WIDE_MAX_CODE_LENGTH 56
+
+typedef struct {
+    uint64_t alphabet;
+    uint64_t length;
+    size_t count;
+    size_t capacity;
+    uint64_t* appear_times;
+    uint32_t* symbols;
+    // The symbol in every slot when hashed, NULL when dense (slot = symbol)
+    uint32_t* ranks;
+    // The index in kind of every slot's symbol
+    uint32_t* kind;
+} WideStats;
+
+int wide_stats_init(WideStats* stats, uint64_t alphabet);
+void wide_stats_free(WideStats* stats);
+int wide_stats_update(WideStats* stats, const uint32_t* symbols, size_t length);
+int wide_stats_finish(WideStats* stats);
+uint64_t wide_stats_appear_times(const WideStats* stats, uint32_t symbol);
+double wide_entropy(const WideStats* stats);
+// wide_stats_update returns -1 for a symbol out of the alphabet or no memory
+
+int build_wide_codes(const WideStats* stats, HuffmanCode codes[]);
+uint64_t wide_coded_bits(const WideStats* stats, const HuffmanCode codes[]);
+long wide_encode(const WideStats* stats, const HuffmanCode codes[], const uint32_t* symbols, size_t length,
+                 unsigned char* out);
+
+/**
+ * WideDecoder decodes canonical codes of a wide alphabet from their lengths
+ * and symbols (kind and codes of the encoder, in the same order).
+ */
+typedef struct {
+    int lengths;
+    int length[WIDE_MAX_CODE_LENGTH];
+    uint64_t first[WIDE_MAX_CODE_LENGTH];
+    uint64_t limit[WIDE_MAX_CODE_LENGTH];
+    uint32_t offset[WIDE_MAX_CODE_LENGTH];
+    uint32_t* symbols;
+} WideDecoder;
+
+int wide_decoder_init(WideDecoder* decoder, const uint32_t kind[], const HuffmanCode codes[], size_t count);
+void wide_decoder_free(WideDecoder* decoder);
+long wide_decode(const WideDecoder* decoder, const unsigned char* in, size_t size, uint32_t* out, size_t length);
+
+uint32_t adler32(uint32_t adler, const unsigned char* data, size_t length);
+
+/**
+ * A block is a 16 bytes header and a payload:
+ *
+ *   mode | flags | table slot | reserved | raw length (u32)
+ *   | payload length (u32) | Adler-32 of the raw data (u32) | payload
+ *
+ * All integers are little endian. The payload of a BLOCK_HUFFMAN block is the
+ * code lengths (see write_code_lengths) and then the bitstream. A
+ * BLOCK_HUFFMAN4 block splits its data into 4 parts of (raw length + 3) / 4
+ * bytes (the last one gets what's left) and codes every part to its own
+ * bitstream, so they can be decoded side by side:
+ *
+ *   code lengths | size of stream 0, 1, 2 (u32) | stream 0 | 1 | 2 | 3
+ *
+ * A BLOCK_TANS block codes the same histogram with tANS instead, which gets
+ * within a fraction of a percent of the entropy where Huffman loses up to a
+ * bit per symbol on skewed data. Its payload is the normalized frequencies
+ * and one bitstream, see entropy.c. The mode is per block, so a file can mix
+ * both engines.
+ *
+ * A BLOCK_RAW payload is the data itself, a BLOCK_RLE payload is the runs of
+ * the data as (symbol, run length - 1 in LEB128). ENGINE_AUTO chooses among
+ * all of them per block from the histogram, see auto_block_mode.
+ */
+typedef struct {
+    int mode;
+    int flags;
+    int table;
+    uint32_t raw_length;
+    uint32_t payload_length;
+    uint32_t checksum;
+} BlockHeader;
+
+void block_header_read(const unsigned char* in, BlockHeader* header);
+size_t entropy_block_bound(size_t length);
+
+typedef enum {
+    ENGINE_HUFFMAN,
+    ENGINE_TANS,
+    ENGINE_AUTO,
+} EntropyEngine;
+
+typedef struct {
+    HuffmanBuilder builder;
+    int max_bits;
+    // 0 means the code lengths aren't limited
+    int streams;
+    // 1 for BLOCK_HUFFMAN, HUFFMAN_STREAMS for BLOCK_HUFFMAN4
+    EntropyEngine engine;
+    // ENGINE_TANS writes BLOCK_TANS blocks, builder, max_bits and streams
+    // are only for Huffman. ENGINE_AUTO picks the mode of every block and
+    // never expands a block by more than its header.
+    int reuse_tables;
+    // Keep the last few tables and code blocks of the same statistics with
+    // them, skipping the build and the table in the block. The blocks then
+    // must be decoded in order by one decoder.
+} EntropyEncoderOptions;
+
+typedef struct EntropyEncoder EntropyEncoder;
+typedef struct EntropyDecoder EntropyDecoder;
+
+/**
+ * entropy_encoder_create returns NULL if options are invalid or there's no
+ * memory. entropy_encode_block writes one block of src to dst, which needs
+ * room for entropy_block_bound(length) bytes, and sets *written to its size.
+ */
+EntropyEncoder* entropy_encoder_create(const EntropyEncoderOptions* options);
+void entropy_encoder_destroy(EntropyEncoder* encoder);
+void entropy_encoder_reset(EntropyEncoder* encoder);
+// Forgets the cached tables, for a new stream of blocks
+EntropyStatus entropy_encode_block(EntropyEncoder* encoder, const uint8_t* src, size_t length,
+                                   uint8_t* dst, size_t capacity, size_t* written);
+
+/**
+ * entropy_decode_block decodes the whole block (header and payload) in src,
+ * dst needs room for its raw length. *written is the number of bytes decoded.
+ */
+EntropyDecoder* entropy_decoder_create(void);
+void entropy_decoder_destroy(EntropyDecoder* decoder);
+void entropy_decoder_reset(EntropyDecoder* decoder);
+EntropyStatus entropy_decode_block(EntropyDecoder* decoder, const uint8_t* src, size_t length,
+                                   uint8_t* dst, size_t capacity, size_t* written);
+
+/**
+ * The _vectors versions take the raw side of a block as count pieces, like the
+ * fragments of a message as they came from the network, and work on them in
+ * place. entropy_encode_block_vectors codes the concatenation of src without
+ * ever making it, to the same block entropy_encode_block writes for it.
+ * entropy_decode_block_vectors fills the pieces of dst in order, together they
+ * need room for the raw length. Pieces of length 0 are fine.
+ */
+EntropyStatus entropy_encode_block_vectors(EntropyEncoder* encoder, const struct iovec* src, int count,
+                                           uint8_t* dst, size_t capacity, size_t* written);
+EntropyStatus entropy_decode_block_vectors(EntropyDecoder* decoder, const uint8_t* src, size_t length,
+                                           const struct iovec* dst, int count, size_t* written);
+
+/**
+ * A dictionary is a pair of tables trained on samples of the data, known to
+ * both sides in advance. A block of 100 bytes can't pay for its own table (a
+ * Huffman or tANS table alone is about 30 to 100 bytes), coded with the
+ * dictionary it takes no table at all (BLOCK_FLAG_DICTIONARY):
+ *
+ *   magic "HDIC" | version | tANS table log | 2 reserved | id (u32)
+ *   | code length of every symbol (256 × u8) | tANS frequencies (256 × u16)
+ *
+ * The layout is fixed so a mapped file is used as it is, there's nothing to
+ * parse and loading it only builds the coder tables once. The id is the
+ * Adler-32 of everything after it, a container names the dictionary it
+ * needs by that id.
+ *
+ * The Huffman table has a code for every byte (the unseen ones get long
+ * codes), the tANS table only for the bytes of the samples. The encoder takes
+ * a dictionary table for a block when it codes every symbol of the block and
+ * costs less than a table of its own would.
+ */
+#define DICTIONARY_MAGIC "HDIC"
+#define DICTIONARY_VERSION 1
+#define DICTIONARY_HEADER_SIZE 12
+#define DICTIONARY_SIZE (DICTIONARY_HEADER_SIZE + ASCII + 2 * ASCII)
+#define DICTIONARY_MAX_BITS 15
+
+EntropyStatus entropy_dictionary_train(const SymbolStats* samples, uint8_t dictionary[DICTIONARY_SIZE]);
+uint32_t entropy_dictionary_id(const uint8_t* dictionary);
+EntropyStatus entropy_encoder_load_dictionary(EntropyEncoder* encoder, const uint8_t* dictionary, size_t size);
+EntropyStatus entropy_decoder_load_dictionary(EntropyDecoder* decoder, const uint8_t* dictionary, size_t size);
+// A loaded dictionary stays through entropy_*_reset
+
+/**
+ * EntropyService compresses many small buffers for an event-driven caller:
+ * submit returns at once, a pool of worker threads encodes the requests and
+ * completes each one by its callback (called on the worker thread) or, with
+ * no callback, into a completion queue read by entropy_service_poll.
+ *
+ *   submit ──► pending ──► worker: take up to `batch` ──► callback
+ *                                  encode them        └─► completion queue
+ *
+ * A worker takes everything pending (up to batch requests) at once, so under
+ * load the batches grow by themselves and nothing waits for a batch to fill.
+ * The requests of a batch share one Huffman table built from their merged
+ * histogram, a request whose own table would be cheaper is coded alone.
+ * Every output is a normal block for entropy_decode_block either way.
+ *
+ * The request belongs to the caller until it's completed, src and dst must
+ * stay valid and dst needs entropy_block_bound(length) bytes.
+ */
+typedef struct EntropyRequest EntropyRequest;
+typedef void (*EntropyCallback)(EntropyRequest* request);
+
+struct EntropyRequest {
+    const uint8_t* src;
+    size_t length;
+    uint8_t* dst;
+    size_t capacity;
+    EntropyCallback callback;
+    void* user;
+    size_t written;
+    EntropyStatus status;
+    // written and status are set when the request is completed
+    EntropyRequest* next;
+    // Used by the service
+};
+
+typedef struct {
+    EntropyEncoderOptions encoder;
+    // reuse_tables must be 0, every request is decoded alone
+    int threads;
+    int batch;
+    const uint8_t* dictionary;
+    size_t dictionary_size;
+    // Optional, the service then codes with it and shares no table
+} EntropyServiceOptions;
+
+typedef struct EntropyService EntropyService;
+
+EntropyService* entropy_service_create(const EntropyServiceOptions* options);
+EntropyStatus entropy_service_submit(EntropyService* service, EntropyRequest* request);
+size_t entropy_service_poll(EntropyService* service, EntropyRequest* done[], size_t max, int wait);
+// Takes up to max completed requests, with wait it blocks until there's one
+// (or none is left to complete)
+void entropy_service_destroy(EntropyService* service);
+// Completes every request submitted so far, then stops the workers
+
+/**
+ * Order1Stats counts every byte in the context of the byte before it, so
+ * row `previous` of counts is the histogram of what follows that byte. The
+ * order-1 entropy is then the entropy of every row weighted by its size:
+ *
+ *   ℍ(X | X₋₁) = ∑ₚ Nₚ / N · ℍ(row p) = (∑ₚ [Nₚ · log₂(Nₚ) - ∑ₓ cₚₓ · log₂(cₚₓ)]) / N
+ *
+ * Counters are 32 bits so the whole table is 256 KiB and mostly stays in L2,
+ * they are added to the 64 bits totals every HISTOGRAM_CHUNK bytes. The
+ * first byte of the input has the context 0.
+ */
+typedef struct {
+    uint32_t counts[ASCII][ASCII];
+    uint64_t (*totals)[ASCII];
+    uint64_t length;
+    uint64_t pending;
+    unsigned char previous;
+} Order1Stats;
+
+int order1_stats_init(Order1Stats* stats);
+void order1_stats_free(Order1Stats* stats);
+void order1_stats_update(Order1Stats* stats, const unsigned char* data, size_t length);
+double order1_entropy(Order1Stats* stats);
+
+/**
+ * Order2Stats is the same with the two bytes before as the context, the
+ * pairs of (context, byte) that appear are kept in a hash table, see
+ * entropy.c. order2_stats_update returns -1 if the table can't grow.
+ */
+typedef struct {
+    uint64_t* entries;
+    int bits;
+    size_t used;
+    uint64_t* context_totals;
+    uint64_t length;
+    uint32_t context;
+} Order2Stats;
+
+int order2_stats_init(Order2Stats* stats);
+void order2_stats_free(Order2Stats* stats);
+int order2_stats_update(Order2Stats* stats, const unsigned char* data, size_t length);
+double order2_entropy(const Order2Stats* stats);
+
+/**
+ * RollingEntropy is the entropy of the last `window` bytes of a stream, see
+ * entropy.c for how it's kept up to date in O(1) per byte.
+ */
+#define MAX_ROLLING_WINDOW (1 << 24)
+
+typedef struct {
+    int64_t* clog2_fixed;
+    unsigned char* ring;
+    uint32_t appear_times[ASCII];
+    size_t window;
+    size_t filled;
+    size_t head;
+    int64_t sum;
+    double log2_window;
+} RollingEntropy;
+
+int rolling_entropy_init(RollingEntropy* rolling, size_t window);
+void rolling_entropy_free(RollingEntropy* rolling);
+void rolling_entropy_push(RollingEntropy* rolling, unsigned char symbol);
+double rolling_entropy_value(const RollingEntropy* rolling);
+
+/**
+ * With -DENTROPY_STATS (for the library and every file using it) the hot
+ * paths record how many times each phase ran, how long it took and how many
+ * bytes went through it, and the min heap counts its operations. That's
+ * enough to see which phase regressed in a slow job without a profiler:
+ *
+ *   histogram   histogram_count (so symbol_stats_update and -j counting too)
+ *   build       the code lengths, heap / in-place builder or package-merge
+ *   codes       canonical_codes after the build
+ *   encode      bitstreams and checksum of a block, or the '0' / '1' text
+ *   decode      a whole block, code table, bitstreams and checksum
+ *   output      writing the result, recorded by the CLI
+ *
+ * The counters are the only global mutable state of the library, they are
+ * added to with relaxed atomics so any thread can record at any time. Without
+ * the flag STATS_BEGIN / STATS_END are empty and nothing is compiled in.
+ */
+#ifdef ENTROPY_STATS
+#include <stdio.h>
+
+typedef enum {
+    STATS_HISTOGRAM,
+    STATS_BUILD,
+    STATS_CODES,
+    STATS_ENCODE,
+    STATS_DECODE,
+    STATS_OUTPUT,
+    STATS_PHASES,
+} StatsPhase;
+
+typedef struct {
+    uint64_t calls;
+    uint64_t nanoseconds;
+    uint64_t bytes;
+} StatsCounter;
+
+typedef struct {
+    StatsCounter phases[STATS_PHASES];
+    uint64_t heap_inserts;
+    uint64_t heap_extracts;
+    uint64_t heap_swaps;
+    // Every swap of a node with its parent or child when sifting up or down
+    uint64_t table_hits;
+    uint64_t table_misses;
+    // Blocks coded with a cached table, or with a new one (reuse_tables)
+} EntropyStats;
+
+uint64_t entropy_stats_clock(void);
+void entropy_stats_record(StatsPhase phase, uint64_t start, uint64_t bytes);
+void entropy_stats_heap(uint64_t inserts, uint64_t extracts, uint64_t swaps);
+void entropy_stats_tables(int hit);
+void entropy_stats_snapshot(EntropyStats* stats);
+void entropy_stats_reset(void);
+void entropy_stats_dump_json(FILE* out);
+
+#define STATS_BEGIN(name) uint64_t name = entropy_stats_clock()
+#define STATS_END(name, phase, bytes) entropy_stats_record(phase, name, bytes)
+#else
+#define STATS_BEGIN(name)
+#define STATS_END(name, phase, bytes)
+#endif
+
+static inline void store_le32(unsigned char* p, uint32_t x) {
+    for (int i = 0; i < 4; ++i) {
+        p[i] = (unsigned char)(x >> (8 * i));
+    }
+}
+
+static inline uint32_t load_le32(const unsigned char* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void store_le64(unsigned char* p, uint64_t x) {
+    for (int i = 0; i < 8; ++i) {
+        p[i] = (unsigned char)(x >> (8 * i));
+    }
+}
+
+static inline uint64_t load_le64(const unsigned char* p) {
+    uint64_t x = 0;
+    for (int i = 0; i < 8; ++i) {
+        x |= (uint64_t)p[i] << (8 * i);
+    }
+    return x;
+}
+
+#endif
\ No newline at end of file